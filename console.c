@@ -2,6 +2,7 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -87,12 +88,23 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->lat = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
 }
 
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter)
+{
+    add_param_choice(name, valp, summary, NULL, setter);
+}
+
+/* Add a new parameter whose value is selected by name */
+void add_param_choice(char *name,
+                      int *valp,
+                      char *summary,
+                      const char *const *choices,
+                      setter_func_t setter)
 {
     param_element_t *next_param = param_list;
     param_element_t **last_loc = &param_list;
@@ -106,6 +118,7 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->name = name;
     param->valp = valp;
     param->summary = summary;
+    param->choices = choices;
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
@@ -178,7 +191,14 @@ static bool interpret_cmda(int argc, char *argv[])
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        uint64_t start = lat_now_ns();
         ok = next_cmd->operation(argc, argv);
+        /* Unless the command list was freed by quitting */
+        if (!quit_flag) {
+            if (!next_cmd->lat)
+                next_cmd->lat = calloc_or_fail(1, sizeof(lat_hist_t), "stats");
+            lat_record(next_cmd->lat, lat_now_ns() - start);
+        }
         if (!ok)
             record_error();
     } else {
@@ -229,6 +249,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->lat)
+            free_array(ele->lat, 1, sizeof(lat_hist_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -250,6 +272,27 @@ static bool do_quit(int argc, char *argv[])
     return ok;
 }
 
+/* Number of choices of a parameter, zero for plain integers */
+static int param_choice_cnt(const param_element_t *param)
+{
+    int cnt = 0;
+    if (param->choices) {
+        while (param->choices[cnt])
+            cnt++;
+    }
+    return cnt;
+}
+
+static void report_param(const param_element_t *param)
+{
+    int value = *param->valp;
+    if (value >= 0 && value < param_choice_cnt(param))
+        report(1, "  %-12s%-12s | %s", param->name, param->choices[value],
+               param->summary);
+    else
+        report(1, "  %-12s%-12d | %s", param->name, value, param->summary);
+}
+
 static bool do_help(int argc, char *argv[])
 {
     cmd_element_t *clist = cmd_list;
@@ -262,8 +305,7 @@ static bool do_help(int argc, char *argv[])
     param_element_t *plist = param_list;
     report(1, "Options:");
     while (plist) {
-        report(1, "  %-12s%-12d | %s", plist->name, *plist->valp,
-               plist->summary);
+        report_param(plist);
         plist = plist->next;
     }
     return true;
@@ -301,8 +343,7 @@ static bool do_option(int argc, char *argv[])
         param_element_t *plist = param_list;
         report(1, "Options:");
         while (plist) {
-            report(1, "  %-12s%-12d | %s", plist->name, *plist->valp,
-                   plist->summary);
+            report_param(plist);
             plist = plist->next;
         }
         return true;
@@ -311,32 +352,38 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
-        /* Get value from next argument */
-        if (i + 1 >= argc) {
-            report(1, "No value given for parameter %s", name);
-            return false;
-        } else if (!get_int(argv[++i], &value)) {
-            report(1, "Cannot parse '%s' as integer", argv[i]);
-            return false;
-        }
         /* Find parameter in list */
         param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
+        while (plist && strcmp(plist->name, name) != 0)
+            plist = plist->next;
         /* Didn't find parameter */
-        if (!found) {
+        if (!plist) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        /* Get value from next argument, either a choice or an integer */
+        if (i + 1 >= argc) {
+            report(1, "No value given for parameter %s", name);
+            return false;
+        }
+        char *arg = argv[++i];
+        int cnt = param_choice_cnt(plist);
+        while (value < cnt && strcmp(plist->choices[value], arg) != 0)
+            value++;
+        if (value == cnt) {
+            if (!get_int(arg, &value)) {
+                report(1, "Cannot parse '%s' as integer", arg);
+                return false;
+            }
+            if (cnt && (value < 0 || value >= cnt)) {
+                report(1, "Invalid value '%s' for parameter %s", arg, name);
+                return false;
+            }
+        }
+        int oldval = *plist->valp;
+        *plist->valp = value;
+        if (plist->setter)
+            plist->setter(oldval);
     }
 
     return true;
@@ -391,6 +438,85 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Run a command that is meant to fail, so that traces can check errors are
+ * reported.  Its failure is not counted as an error
+ */
+static bool do_xfail(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "No command given");
+        return false;
+    }
+
+    int cnt = err_cnt;
+    bool quit = quit_flag;
+    if (interpret_cmda(argc - 1, argv + 1)) {
+        report(1, "ERROR: '%s' was expected to fail", argv[1]);
+        return false;
+    }
+
+    err_cnt = cnt;
+    quit_flag = quit;
+    return true;
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    bool reset = argc == 2 && !strcmp(argv[1], "reset");
+    bool json = argc == 2 && !strcmp(argv[1], "json");
+    if (argc > 2 || (argc == 2 && !reset && !json)) {
+        report(1, "%s takes an optional 'reset' or 'json'", argv[0]);
+        return false;
+    }
+
+    if (reset) {
+        for (cmd_element_t *c = cmd_list; c; c = c->next) {
+            if (c->lat)
+                memset(c->lat, 0, sizeof(lat_hist_t));
+        }
+        return true;
+    }
+
+    /* Times in nanoseconds, of the commands run since the last reset */
+    if (json)
+        report(1, "{");
+    else
+        report(1, "%-12s %8s %12s %12s %12s %12s %12s %12s", "Command", "Count",
+               "Mean", "p50", "p90", "p99", "p99.9", "Max");
+    /* Last command to show, which takes no comma in JSON */
+    const cmd_element_t *last = NULL;
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->lat && c->lat->total)
+            last = c;
+    }
+
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        const lat_hist_t *h = c->lat;
+        if (!h || !h->total)
+            continue;
+
+        uint64_t mean = h->sum / h->total;
+        uint64_t p50 = lat_percentile(h, 50), p90 = lat_percentile(h, 90);
+        uint64_t p99 = lat_percentile(h, 99), p999 = lat_percentile(h, 99.9);
+        if (json)
+            report(1,
+                   "  \"%s\": {\"count\": %" PRIu64 ", \"mean\": %" PRIu64
+                   ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+                   ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64
+                   ", \"max\": %" PRIu64 "}%s",
+                   c->name, h->total, mean, p50, p90, p99, p999, h->max,
+                   c == last ? "" : ",");
+        else
+            report(1,
+                   "%-12s %8" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64
+                   " %12" PRIu64 " %12" PRIu64 " %12" PRIu64,
+                   c->name, h->total, mean, p50, p90, p99, p999, h->max);
+    }
+    if (json)
+        report(1, "}");
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -429,7 +555,13 @@ void init_cmd()
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(xfail, "Run command, which must fail", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(stats,
+                "Show the count, mean, percentiles and maximum of the time of "
+                "every command in nanoseconds, reset them, or show them as "
+                "JSON",
+                "[reset|json]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
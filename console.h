@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <sys/select.h>
 
+#include "latency.h"
 #include "linenoise.h"
 
 #define HISTORY_FILE ".cmd_history"
@@ -24,6 +25,8 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    /* Wall time of each run in nanoseconds, allocated by the first run */
+    lat_hist_t *lat;
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -35,6 +38,8 @@ typedef struct __param_element {
     char *name;
     int *valp;
     char *summary;
+    /* Optional names of the values, terminated by NULL */
+    const char *const *choices;
     /* Function that gets called whenever parameter changes */
     setter_func_t setter;
     struct __param_element *next;
@@ -50,6 +55,15 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
+/* Add a new parameter which can also be set by the name of a value.
+ * choices is terminated by NULL, and value i is named choices[i]
+ */
+void add_param_choice(char *name,
+                      int *valp,
+                      char *summary,
+                      const char *const *choices,
+                      setter_func_t setter);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
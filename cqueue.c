@@ -0,0 +1,115 @@
+/* Concurrent FIFO queue of strings */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+#include "queue.h"
+
+/* Keep the head and tail sides on separate cache lines */
+#define CACHE_LINE 64
+
+struct side {
+    pthread_mutex_t *lock;
+    struct list_head *node;
+};
+
+/* @head.node is the dummy node and @tail.node the last one, the dummy node
+ * when the queue is empty.  Both locks are @lock[0] when there is a single
+ * lock.
+ */
+struct cqueue {
+    struct side head;
+    char pad0[CACHE_LINE - sizeof(struct side)];
+    struct side tail;
+    char pad1[CACHE_LINE - sizeof(struct side)];
+    pthread_mutex_t lock[2];
+};
+
+/* Create an element holding s, linked to nothing */
+static element_t *cqElement(const char *s)
+{
+    size_t len = strlen(s);
+    element_t *e = malloc(sizeof(element_t) + len + 1);
+    if (!e)
+        return NULL;
+
+    e->value = memcpy(e->data, s, len + 1);
+    e->key = q_key(s);
+    e->len = len;
+    e->list.next = NULL;
+    e->list.prev = NULL;
+    return e;
+}
+
+cqueue_t *cq_new(bool two_lock)
+{
+    cqueue_t *q = malloc(sizeof(cqueue_t));
+    if (!q)
+        return NULL;
+    element_t *dummy = cqElement("");
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+
+    pthread_mutex_init(&q->lock[0], NULL);
+    pthread_mutex_init(&q->lock[1], NULL);
+    q->head = (struct side){&q->lock[0], &dummy->list};
+    q->tail = (struct side){&q->lock[two_lock], &dummy->list};
+    return q;
+}
+
+void cq_free(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    struct list_head *node = q->head.node;
+    while (node) {
+        struct list_head *next = node->next;
+        free(list_entry(node, element_t, list));
+        node = next;
+    }
+    pthread_mutex_destroy(&q->lock[0]);
+    pthread_mutex_destroy(&q->lock[1]);
+    free(q);
+}
+
+/* The next pointer of the last node is the only memory both sides touch:
+ * when the queue is empty, the dummy node is also the last node.  It is
+ * published with release semantics, so that a remover seeing the new node
+ * also sees its string.
+ */
+bool cq_insert_tail(cqueue_t *q, const char *s)
+{
+    element_t *e = cqElement(s);
+    if (!e)
+        return false;
+
+    pthread_mutex_lock(q->tail.lock);
+    __atomic_store_n(&q->tail.node->next, &e->list, __ATOMIC_RELEASE);
+    q->tail.node = &e->list;
+    pthread_mutex_unlock(q->tail.lock);
+    return true;
+}
+
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize)
+{
+    pthread_mutex_lock(q->head.lock);
+    struct list_head *dummy = q->head.node;
+    struct list_head *first = __atomic_load_n(&dummy->next, __ATOMIC_ACQUIRE);
+    if (!first) {
+        pthread_mutex_unlock(q->head.lock);
+        return false;
+    }
+
+    /* Copy before unlocking, as the next remover frees the new dummy node */
+    q_element_copy(list_entry(first, element_t, list), sp, bufsize);
+    q->head.node = first;
+    pthread_mutex_unlock(q->head.lock);
+
+    free(list_entry(dummy, element_t, list));
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/* Concurrent FIFO queue of strings.
+ *
+ * This is the two-lock queue of Michael and Scott: elements are singly
+ * linked through the next pointer of their list node, from a dummy node at
+ * head to the last node at tail.  Inserting only takes the tail lock and
+ * removing only the head lock, and the dummy node keeps both ends apart even
+ * when the queue is empty, so producers and consumers do not contend.
+ *
+ * Removing copies the string of the first element and makes this element
+ * the new dummy node, freeing the previous one.
+ *
+ * For comparison, a queue may be created with a single lock guarding both
+ * ends instead.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct cqueue cqueue_t;
+
+/**
+ * cq_new() - Create an empty queue
+ * @two_lock: whether inserting and removing take separate locks
+ *
+ * Return: NULL for allocation failed
+ */
+cqueue_t *cq_new(bool two_lock);
+
+/**
+ * cq_free() - Free the queue and its elements, no effect if NULL
+ * @q: queue to free
+ *
+ * No other thread may use the queue anymore.
+ */
+void cq_free(cqueue_t *q);
+
+/**
+ * cq_insert_tail() - Insert an element at tail of queue
+ * @q: queue to insert into
+ * @s: string would be inserted
+ *
+ * Safe to call from any number of threads at once.
+ *
+ * Return: true for success, false for allocation failed
+ */
+bool cq_insert_tail(cqueue_t *q, const char *s);
+
+/**
+ * cq_remove_head() - Remove the element from head of queue
+ * @q: queue to remove from
+ * @sp: if non-NULL, receives the removed string
+ * @bufsize: size of @sp
+ *
+ * As q_remove_head(), up to @bufsize - 1 characters are copied, plus a null
+ * terminator.  The element is freed.  Safe to call from any number of
+ * threads at once.
+ *
+ * Return: true for success, false if queue is empty
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize);
+
+#endif /* LAB0_CQUEUE_H */
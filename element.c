@@ -0,0 +1,225 @@
+/* Elements, interned strings and settings shared by all the queue
+ * implementations
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+int q_prefix_key = 1;
+_Thread_local q_cmp_stat_t q_cmp_stat;
+
+int q_intern = 0;
+q_intern_stat_t q_intern_stat;
+
+int q_sort_threads = 1;
+int q_sort_threshold = 50000;
+
+/* Interned string, shared by all the elements holding an equal string */
+struct intern_str {
+    struct intern_str *next; /* next string in the same bucket */
+    uint32_t hash;
+    size_t refcnt;
+    size_t len;
+    char s[];
+};
+
+/* Hash table of the interned strings, with as many buckets as strings.
+ * Single threaded, see q_intern.
+ */
+static struct {
+    struct intern_str **bucket;
+    size_t size; /* number of buckets, a power of 2 */
+} intern_table;
+
+/* Double the buckets, keeping the current ones if allocation fails */
+static void internGrow()
+{
+    size_t size = intern_table.size ? intern_table.size * 2 : 64;
+    struct intern_str **bucket = malloc(size * sizeof(*bucket));
+    if (!bucket)
+        return;
+    memset(bucket, 0, size * sizeof(*bucket));
+
+    for (size_t i = 0; i < intern_table.size; i++) {
+        struct intern_str *is = intern_table.bucket[i], *next;
+        for (; is; is = next) {
+            next = is->next;
+            is->next = bucket[is->hash & (size - 1)];
+            bucket[is->hash & (size - 1)] = is;
+        }
+    }
+    free(intern_table.bucket);
+    intern_table.bucket = bucket;
+    intern_table.size = size;
+}
+
+/* Get a reference to the interned copy of s, NULL on allocation failure */
+static struct intern_str *internGet(const char *s, size_t len)
+{
+    uint32_t hash = q_str_hash(s, len);
+    if (intern_table.size) {
+        struct intern_str *is =
+            intern_table.bucket[hash & (intern_table.size - 1)];
+        for (; is; is = is->next) {
+            if (is->hash == hash && is->len == len && !memcmp(is->s, s, len))
+                break;
+        }
+        if (is) {
+            is->refcnt++;
+            q_intern_stat.refs++;
+            q_intern_stat.ref_bytes += len + 1;
+            return is;
+        }
+    }
+
+    if (q_intern_stat.strings >= intern_table.size)
+        internGrow();
+    if (!intern_table.size)
+        return NULL;
+
+    struct intern_str *is = malloc(sizeof(struct intern_str) + len + 1);
+    if (!is)
+        return NULL;
+    memcpy(is->s, s, len + 1);
+    is->hash = hash;
+    is->len = len;
+    is->refcnt = 1;
+    is->next = intern_table.bucket[hash & (intern_table.size - 1)];
+    intern_table.bucket[hash & (intern_table.size - 1)] = is;
+
+    q_intern_stat.strings++;
+    q_intern_stat.refs++;
+    q_intern_stat.bytes += len + 1;
+    q_intern_stat.ref_bytes += len + 1;
+    return is;
+}
+
+/* Drop a reference to an interned string */
+void q_intern_put(char *s)
+{
+    struct intern_str *is =
+        (struct intern_str *) (s - offsetof(struct intern_str, s));
+    q_intern_stat.refs--;
+    q_intern_stat.ref_bytes -= is->len + 1;
+    if (--is->refcnt)
+        return;
+
+    struct intern_str **pp =
+        &intern_table.bucket[is->hash & (intern_table.size - 1)];
+    while (*pp != is)
+        pp = &(*pp)->next;
+    *pp = is->next;
+    q_intern_stat.bytes -= is->len + 1;
+    free(is);
+
+    /* Leave nothing allocated once the last string is gone */
+    if (!--q_intern_stat.strings) {
+        free(intern_table.bucket);
+        intern_table.bucket = NULL;
+        intern_table.size = 0;
+    }
+}
+
+/* Allocate an element holding a copy of s in its inline storage, or a
+ * reference to its interned copy, charged to the given call site
+ */
+element_t *q_element_new_at(slab_cache_t *cache,
+                            const char *s,
+                            const char *file,
+                            int line,
+                            const char *func)
+{
+    size_t len = strlen(s);
+    if (q_intern) {
+        struct intern_str *is = internGet(s, len);
+        if (!is)
+            return NULL;
+        element_t *new_node =
+            slab_alloc_at(cache, sizeof(element_t), file, line, func);
+        if (!new_node) {
+            q_intern_put(is->s);
+            return NULL;
+        }
+        new_node->value = is->s;
+        new_node->len = len;
+        new_node->key = q_key(new_node->value);
+        return new_node;
+    }
+
+    element_t *new_node =
+        slab_alloc_at(cache, sizeof(element_t) + len + 1, file, line, func);
+    /*malloc failure*/
+    if (!new_node)
+        return NULL;
+
+    new_node->value = memcpy(new_node->data, s, len + 1);
+    new_node->len = len;
+    new_node->key = q_key(new_node->value);
+    return new_node;
+}
+
+/* Copy the string of e to sp, truncated to fit in bufsize bytes.  Unlike
+ * strncpy(), nothing is written past the terminator.
+ */
+void q_element_copy(const element_t *e, char *sp, size_t bufsize)
+{
+    if (!sp || !bufsize)
+        return;
+
+    size_t len = e->len < bufsize ? e->len : bufsize - 1;
+    memcpy(sp, e->value, len);
+    sp[len] = '\0';
+}
+
+/* Hand the string of a removed element over, releasing the element itself
+ * if the string is interned
+ */
+char *q_element_take(element_t *e, size_t *len)
+{
+    if (!e)
+        return NULL;
+
+    char *s = e->value;
+    if (len)
+        *len = e->len;
+    if (s != e->data)
+        slab_free(e);
+    return s;
+}
+
+void q_alarm_block(sigset_t *oldmask)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, oldmask);
+}
+
+void q_alarm_restore(const sigset_t *oldmask)
+{
+    pthread_sigmask(SIG_SETMASK, oldmask, NULL);
+}
+
+/* Release a string handed over by q_take_head() or q_take_tail() */
+void q_release_string(char *s)
+{
+    /* An interned string is found in the table at its very address */
+    if (q_intern_stat.strings) {
+        size_t len = strlen(s);
+        uint32_t hash = q_str_hash(s, len);
+        struct intern_str *is =
+            intern_table.bucket[hash & (intern_table.size - 1)];
+        for (; is; is = is->next) {
+            if (is->s == s) {
+                q_intern_put(s);
+                return;
+            }
+        }
+    }
+    q_release_element((element_t *) (s - offsetof(element_t, data)));
+}
@@ -1,12 +1,16 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -27,48 +31,310 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Bytes filled at each end of the payload in POISON_EDGES mode */
+#define POISON_EDGE 64
+
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+/* Header of every allocated block, registered in the block registry, which
+ * also keeps the call site of the block.  Unless in compact mode, BLOCK_PAD
+ * bytes are left in front of the header, so that the payload keeps the
+ * alignment of malloc.
  */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
-    size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t payload_size;
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+#define BLOCK_PAD 8
+
+/* Registry of allocated blocks: an open-addressing hash set of their
+ * addresses, probed linearly.  Removing a block shifts the following blocks
+ * of its cluster back instead of leaving a tombstone, so lookups stay short.
+ * registry_site[i] is the index in sites of the call site of registry[i].
+ */
+static block_element_t **registry = NULL;
+static unsigned char *registry_site = NULL;
+static size_t registry_cap = 0; /* power of two, 0 before the first block */
+static size_t registry_count = 0;
+
+/* Smallest registry, which also never shrinks below this */
+#define REGISTRY_MIN 1024
+
+static atomic_size_t allocated_count = 0;
+
+/* Guards the registry, so that the allocation functions may be called from
+ * several threads
+ */
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Call sites of allocations, hashed by file and line.  sites[0] gathers
+ * the allocations whose site is unknown or did not fit.  Guarded by
+ * block_lock.
+ */
+static alloc_site_t sites[ALLOC_SITES];
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Seed of the malloc failure generators, random if 0 */
+int fail_seed = 0;
+
+/* Every thread draws malloc failures from its own splitmix64 generator,
+ * seeded again whenever fail_generation moved on since it last was
+ */
+static _Thread_local uint64_t fail_state;
+static _Thread_local unsigned fail_seen, fail_thread;
+static atomic_uint fail_generation = 1, fail_threads = 0;
+
+int poison_mode = POISON_FULL;
+
+int quarantine_bytes = 0;
+
+/* Quarantine of freed blocks: a FIFO ring of the blocks and their payload
+ * sizes, kept apart from the headers which writes after free may clobber.
+ * Guarded by block_lock.
+ */
+struct quarantined {
+    block_element_t *block;
+    size_t size;
+};
+static struct quarantined *quarantine = NULL;
+static size_t quarantine_cap = 0; /* power of two */
+static size_t quarantine_first = 0, quarantine_count = 0;
+static size_t quarantine_held = 0; /* payload bytes of the blocks */
+
+/* Smallest quarantine ring */
+#define QUARANTINE_MIN 256
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
+static bool compact_mode = false;
+static atomic_bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+int budget_ms = 1000;
+
+/* Interval timer raising SIGALRM once the budget of an operation is spent,
+ * created by the first time limited operation
+ */
+static timer_t budget_timer;
+static bool budget_timer_ready = false, budget_timer_broken = false;
+static struct timespec budget_start;
+static uint64_t budget_last_ns = 0, budget_peak_ns = 0;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
+/* Data for managing exceptions, which only unwind the thread that set them
+ * up
+ */
+static _Thread_local sigjmp_buf env;
+static _Thread_local volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
 
+/* Nesting of allocator calls in the thread.  An exception triggered inside
+ * the allocator is held back until the outermost call returns, so that
+ * neither malloc nor block_lock is left half way
+ */
+static _Thread_local volatile sig_atomic_t alloc_depth = 0;
+static _Thread_local char *volatile alloc_pending = NULL;
+
 /* Internal functions */
 
+static uint64_t fail_next()
+{
+    uint64_t z = (fail_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (!fail_probability)
+        return false;
+
+    unsigned generation = atomic_load_explicit(&fail_generation,
+                                               memory_order_relaxed);
+    if (fail_seen != generation) {
+        /* Threads are numbered in the order they first fail allocations, so
+         * that a given seed gives the main thread the same failures
+         */
+        if (!fail_thread)
+            fail_thread = ++fail_threads;
+        fail_state = fail_seed ? (uint64_t) fail_seed << 32 | fail_thread
+                               : os_random(fail_thread);
+        fail_seen = generation;
+    }
+
+    /* 32 random bits below fail_probability percent of 2^32 */
+    return (fail_next() >> 32) * 100 < (uint64_t) fail_probability << 32;
+}
+
+void fail_reseed()
+{
+    fail_generation++;
+}
+
+/* Home slot of a block in the registry */
+static size_t registry_home(const block_element_t *b)
+{
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> 32) & (registry_cap - 1);
+}
+
+/* Slot holding b, or the empty slot ending its probe sequence */
+static size_t registry_slot(const block_element_t *b)
+{
+    size_t i = registry_home(b);
+    while (registry[i] && registry[i] != b)
+        i = (i + 1) & (registry_cap - 1);
+    return i;
+}
+
+static bool registry_resize(size_t cap)
+{
+    block_element_t **old = registry;
+    unsigned char *old_site = registry_site;
+    size_t old_cap = registry_cap;
+    registry = calloc(cap, sizeof(*registry));
+    registry_site = malloc(cap);
+    if (!registry || !registry_site) {
+        free(registry);
+        free(registry_site);
+        registry = old;
+        registry_site = old_site;
+        return false;
+    }
+
+    registry_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i]) {
+            size_t j = registry_slot(old[i]);
+            registry[j] = old[i];
+            registry_site[j] = old_site[i];
+        }
+    }
+    free(old);
+    free(old_site);
+    return true;
+}
+
+/* Keep the load factor at most 1/2 */
+static bool registry_add(block_element_t *b, uint32_t site)
+{
+    if ((registry_count + 1) * 2 > registry_cap &&
+        !registry_resize(registry_cap ? 2 * registry_cap : REGISTRY_MIN))
+        return false;
+
+    size_t i = registry_slot(b);
+    registry[i] = b;
+    registry_site[i] = site;
+    registry_count++;
+    return true;
+}
+
+static bool registry_contains(const block_element_t *b)
+{
+    return registry_cap && registry[registry_slot(b)];
+}
+
+/* Remove a block, and return the index of its call site, ALLOC_SITES if
+ * it is not registered
+ */
+static uint32_t registry_remove(const block_element_t *b)
+{
+    if (!registry_contains(b))
+        return ALLOC_SITES;
+
+    /* Move back every later block of the cluster whose home slot is not
+     * between the hole and its current slot, cyclically
+     */
+    size_t mask = registry_cap - 1, hole = registry_slot(b);
+    uint32_t site = registry_site[hole];
+    for (size_t i = (hole + 1) & mask; registry[i]; i = (i + 1) & mask) {
+        size_t home = registry_home(registry[i]);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            registry[hole] = registry[i];
+            registry_site[hole] = registry_site[i];
+            hole = i;
+        }
+    }
+    registry[hole] = NULL;
+    registry_count--;
+
+    if (registry_cap > REGISTRY_MIN && registry_count * 8 < registry_cap)
+        registry_resize(registry_cap / 2);
+    return site;
+}
+
+/* Index of the call site in sites, added if new */
+static uint32_t site_find(const char *file, int line, const char *func)
+{
+    if (!file)
+        return 0;
+
+    uint32_t i = ((uintptr_t) file * 31 + line) % (ALLOC_SITES - 1) + 1;
+    for (int probes = 1; probes < ALLOC_SITES; probes++) {
+        alloc_site_t *s = &sites[i];
+        if (!s->file) {
+            s->file = file;
+            s->line = line;
+            s->func = func;
+            return i;
+        }
+        if (s->line == line && (s->file == file || !strcmp(s->file, file)))
+            return i;
+        i = i % (ALLOC_SITES - 1) + 1;
+    }
+    return 0;
+}
+
+/* Size class of an allocation: the smallest i with size <= 2^i, except that
+ * the last class takes every larger size too
+ */
+static int size_class(size_t size)
+{
+    int c = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+    return c < ALLOC_SIZE_CLASSES - 1 ? c : ALLOC_SIZE_CLASSES - 1;
+}
+
+/* Charge an allocation of size bytes to its call site, whose index is
+ * returned.  Called with block_lock held.
+ */
+static uint32_t site_charge(size_t size,
+                            const char *file,
+                            int line,
+                            const char *func)
+{
+    uint32_t site = site_find(file, line, func);
+    alloc_site_t *s = &sites[site];
+    s->allocs++;
+    s->bytes += size;
+    s->live += size;
+    if (s->live > s->peak)
+        s->peak = s->live;
+    s->sizes[size_class(size)]++;
+    return site;
+}
+
+/* Bytes allocated in front of the header of every block */
+static inline size_t block_pad()
+{
+    return compact_mode ? 0 : BLOCK_PAD;
+}
+
+/* Release the memory of a block */
+static void block_release(block_element_t *b)
+{
+    free((char *) b - block_pad());
 }
 
 /* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+ * Signal error if doesn't seem like legitimate block, and return NULL if it
+ * is known not to be allocated.
+ * Called with block_lock held.
  */
 static block_element_t *find_header(void *p)
 {
@@ -81,17 +347,12 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!registry_contains(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
+            return NULL;
         }
     }
 
@@ -107,55 +368,162 @@ static block_element_t *find_header(void *p)
 }
 
 /* Given pointer to block, find its footer */
-static size_t *find_footer(block_element_t *b)
+static uint32_t *find_footer(block_element_t *b)
 {
     // cppcheck-suppress nullPointerRedundantCheck
-    size_t *p =
-        (size_t *) ((size_t) b + b->payload_size + sizeof(block_element_t));
+    uint32_t *p =
+        (uint32_t *) ((size_t) b + b->payload_size + sizeof(block_element_t));
     return p;
 }
 
 /* Implementation of application functions */
 
-void *test_malloc(size_t size)
+/* Fill the payload of a new or freed block with FILLCHAR, as far as
+ * poison_mode asks for
+ */
+static void poison(unsigned char *p, size_t size)
 {
-    if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to malloc disallowed");
-        return NULL;
+    switch (poison_mode) {
+    case POISON_OFF:
+        return;
+    case POISON_EDGES:
+        if (size > 2 * POISON_EDGE) {
+            memset(p, FILLCHAR, POISON_EDGE);
+            memset(p + size - POISON_EDGE, FILLCHAR, POISON_EDGE);
+            return;
+        }
+        /* fall through */
+    default:
+        memset(p, FILLCHAR, size);
     }
+}
 
-    if (fail_allocation()) {
-        report_event(MSG_WARN, "Malloc returning NULL");
+/* Hold a freed block in quarantine */
+static bool quarantine_add(block_element_t *b)
+{
+    if (quarantine_count == quarantine_cap) {
+        size_t cap = quarantine_cap ? 2 * quarantine_cap : QUARANTINE_MIN;
+        struct quarantined *q = malloc(cap * sizeof(*q));
+        if (!q)
+            return false;
+        for (size_t i = 0; i < quarantine_count; i++)
+            q[i] = quarantine[(quarantine_first + i) & (quarantine_cap - 1)];
+        free(quarantine);
+        quarantine = q;
+        quarantine_cap = cap;
+        quarantine_first = 0;
+    }
+
+    size_t i = (quarantine_first + quarantine_count++) & (quarantine_cap - 1);
+    quarantine[i] = (struct quarantined){b, b->payload_size};
+    quarantine_held += b->payload_size;
+    return true;
+}
+
+/* Whether a quarantined block is just as test_free left it */
+static bool quarantine_intact(block_element_t *b, size_t size)
+{
+    if (b->magic_header != MAGICFREE || b->payload_size != size ||
+        *find_footer(b) != MAGICFREE)
+        return false;
+
+    /* All bytes equal the first one */
+    return !size ||
+           (b->payload[0] == FILLCHAR &&
+            !memcmp(b->payload, b->payload + 1, size - 1));
+}
+
+/* Check and release the oldest quarantined blocks until at most keep bytes
+ * are held.  Return false if any was written after free.  Called with
+ * block_lock held.
+ */
+static bool quarantine_evict(size_t keep)
+{
+    bool ok = true;
+    while (quarantine_count && quarantine_held > keep) {
+        struct quarantined *q = &quarantine[quarantine_first];
+        quarantine_first = (quarantine_first + 1) & (quarantine_cap - 1);
+        quarantine_count--;
+        quarantine_held -= q->size;
+
+        if (!quarantine_intact(q->block, q->size)) {
+            report_event(MSG_ERROR,
+                         "Block with address %p was written after being "
+                         "freed",
+                         (void *) q->block->payload);
+            error_occurred = true;
+            ok = false;
+        }
+        block_release(q->block);
+    }
+    return ok;
+}
+
+/* Allocate and register a new block, bypassing failure injection */
+static void *alloc_block(size_t size,
+                         const char *file,
+                         int line,
+                         const char *func)
+{
+    if (size > UINT32_MAX) {
+        report_event(MSG_WARN, "Malloc of %zu bytes exceeds block size limit",
+                     size);
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
+    alloc_enter();
+    size_t pad = block_pad();
+    char *mem = malloc(pad + sizeof(block_element_t) + size + sizeof(uint32_t));
+    if (!mem) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
+    block_element_t *new_block = (block_element_t *) (mem + pad);
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+    poison(p, size);
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+    pthread_mutex_lock(&block_lock);
+    uint32_t site = site_charge(size, file, line, func);
+    if (!registry_add(new_block, site)) {
+        report_event(MSG_FATAL, "Couldn't register block %p", p);
+        error_occurred = true;
+    }
     allocated_count++;
+    pthread_mutex_unlock(&block_lock);
+    alloc_leave();
 
     return p;
 }
 
+void *test_malloc_at(size_t size,
+                     const char *file,
+                     int line,
+                     const char *func)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return NULL;
+    }
+
+    return alloc_block(size, file, line, func);
+}
+
+void *test_malloc(size_t size)
+{
+    return test_malloc_at(size, NULL, 0, NULL);
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -178,8 +546,15 @@ void test_free(void *p)
     if (!p)
         return;
 
+    alloc_enter();
+    pthread_mutex_lock(&block_lock);
     block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
+    if (!b) {
+        pthread_mutex_unlock(&block_lock);
+        alloc_leave();
+        return;
+    }
+    uint32_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
@@ -189,38 +564,168 @@ void test_free(void *p)
     }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
-    free(b);
+    uint32_t site = registry_remove(b);
     allocated_count--;
+    if (site < ALLOC_SITES) {
+        sites[site].frees++;
+        sites[site].live -= b->payload_size;
+    }
+
+    /* Quarantined blocks are filled whole, whatever the poison mode, to
+     * detect any write to them
+     */
+    if (quarantine_bytes > 0) {
+        memset(p, FILLCHAR, b->payload_size);
+        if (quarantine_add(b)) {
+            quarantine_evict(quarantine_bytes);
+            pthread_mutex_unlock(&block_lock);
+            alloc_leave();
+            return;
+        }
+    } else {
+        poison(p, b->payload_size);
+    }
+    pthread_mutex_unlock(&block_lock);
+
+    block_release(b);
+    alloc_leave();
 }
 
-// cppcheck-suppress unusedFunction
-char *test_strdup(const char *s)
+char *test_strdup_at(const char *s,
+                     const char *file,
+                     int line,
+                     const char *func)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = test_malloc_at(len, file, line, func);
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+// cppcheck-suppress unusedFunction
+char *test_strdup(const char *s)
+{
+    return test_strdup_at(s, NULL, 0, NULL);
+}
+
 size_t allocation_check()
 {
     return allocated_count;
 }
 
+bool quarantine_trim(size_t keep)
+{
+    pthread_mutex_lock(&block_lock);
+    bool ok = quarantine_evict(keep);
+    pthread_mutex_unlock(&block_lock);
+    return ok;
+}
+
+/* Most bytes first */
+static int site_cmp(const void *a, const void *b)
+{
+    size_t x = ((const alloc_site_t *) a)->bytes;
+    size_t y = ((const alloc_site_t *) b)->bytes;
+    return (x < y) - (x > y);
+}
+
+size_t alloc_sites(alloc_site_t *top, size_t n)
+{
+    alloc_site_t *all = malloc(sizeof(sites));
+    if (!all)
+        return 0;
+
+    size_t used = 0;
+    pthread_mutex_lock(&block_lock);
+    for (int i = 0; i < ALLOC_SITES; i++) {
+        if (sites[i].allocs)
+            all[used++] = sites[i];
+    }
+    pthread_mutex_unlock(&block_lock);
+
+    qsort(all, used, sizeof(*all), site_cmp);
+    if (n > used)
+        n = used;
+    memcpy(top, all, n * sizeof(*all));
+    free(all);
+    return n;
+}
+
+/* Implementation of slab support */
+
+void *test_malloc_slab(size_t size)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return NULL;
+    }
+
+    return alloc_block(size, "slabs", 0, "test_malloc_slab");
+}
+
+int test_slab_claim(size_t size, const char *file, int line, const char *func)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return -1;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return -1;
+    }
+
+    alloc_enter();
+    pthread_mutex_lock(&block_lock);
+    allocated_count++;
+    int site = site_charge(size, file, line, func);
+    pthread_mutex_unlock(&block_lock);
+    alloc_leave();
+    return site;
+}
+
+void test_slab_release(int site, size_t cnt, size_t bytes)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to free disallowed");
+        return;
+    }
+
+    alloc_enter();
+    pthread_mutex_lock(&block_lock);
+    allocated_count -= cnt;
+    sites[site].frees += cnt;
+    sites[site].live -= bytes;
+    pthread_mutex_unlock(&block_lock);
+    alloc_leave();
+}
+
+void alloc_enter()
+{
+    alloc_depth++;
+}
+
+void alloc_leave()
+{
+    if (--alloc_depth == 0 && alloc_pending) {
+        char *msg = alloc_pending;
+        alloc_pending = NULL;
+        trigger_exception(msg);
+    }
+}
+
+void test_slab_error(void *p)
+{
+    report_event(MSG_ERROR,
+                 "Attempted to free unallocated or already freed slab "
+                 "object.  Address = %p",
+                 p);
+    error_occurred = true;
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -231,6 +736,21 @@ void set_cautious_mode(bool cautious)
     cautious_mode = cautious;
 }
 
+/* Switch the block layout, once every block is freed.  Quarantined blocks
+ * are released first
+ */
+bool set_compact_mode(bool compact)
+{
+    pthread_mutex_lock(&block_lock);
+    if (compact != compact_mode)
+        quarantine_evict(0);
+    bool ok = compact == compact_mode || !allocated_count;
+    if (ok)
+        compact_mode = compact;
+    pthread_mutex_unlock(&block_lock);
+    return ok;
+}
+
 /* Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
  */
@@ -242,34 +762,91 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
-/* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
- */
-bool exception_setup(bool limit_time)
-{
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
-        jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
+/* Arm the budget timer for one operation of budget_ms */
+static void budget_arm()
+{
+    clock_gettime(CLOCK_MONOTONIC, &budget_start);
+    if (budget_ms <= 0)
+        return;
+
+    if (!budget_timer_ready) {
+        if (budget_timer_broken)
+            return;
+
+        struct sigevent ev = {
+            .sigev_notify = SIGEV_SIGNAL,
+            .sigev_signo = SIGALRM,
+        };
+        if (timer_create(CLOCK_MONOTONIC, &ev, &budget_timer)) {
+            report_event(MSG_WARN,
+                         "Couldn't create the time budget timer, operations "
+                         "are not time limited");
+            budget_timer_broken = true;
+            return;
         }
+        budget_timer_ready = true;
+    }
 
-        if (error_message)
-            report_event(MSG_ERROR, error_message);
-        error_message = "";
-        return false;
+    struct itimerspec its = {
+        .it_value = {budget_ms / 1000, budget_ms % 1000 * 1000000L},
+    };
+    timer_settime(budget_timer, 0, &its, NULL);
+}
+
+/* Disarm the budget timer and record the time the operation took */
+static void budget_disarm()
+{
+    if (budget_timer_ready) {
+        struct itimerspec its = {0};
+        timer_settime(budget_timer, 0, &its, NULL);
     }
 
-    /* Got here from initial call */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    budget_last_ns = (uint64_t) (now.tv_sec - budget_start.tv_sec) *
+                         1000000000 +
+                     now.tv_nsec - budget_start.tv_nsec;
+    if (budget_last_ns > budget_peak_ns)
+        budget_peak_ns = budget_last_ns;
+}
+
+void budget_usage(uint64_t *last_ns, uint64_t *peak_ns, bool reset)
+{
+    *last_ns = budget_last_ns;
+    *peak_ns = budget_peak_ns;
+    if (reset)
+        budget_peak_ns = 0;
+}
+
+sigjmp_buf *exception_env()
+{
+    return &env;
+}
+
+/* Got to exception_setup from longjmp */
+bool exception_caught()
+{
+    jmp_ready = false;
+    if (time_limited) {
+        budget_disarm();
+        time_limited = false;
+    }
+
+    if (error_message)
+        report_event(MSG_ERROR, error_message);
+    error_message = "";
+    return false;
+}
+
+/* Got to exception_setup from initial call */
+bool exception_armed(bool limit_time)
+{
     jmp_ready = true;
     if (limit_time) {
-        alarm(time_limit);
+        budget_arm();
         time_limited = true;
     }
     return true;
@@ -279,7 +856,7 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
+        budget_disarm();
         time_limited = false;
     }
 
@@ -291,6 +868,11 @@ void exception_cancel()
 void trigger_exception(char *msg)
 {
     error_occurred = true;
+    if (alloc_depth) {
+        alloc_pending = msg;
+        return;
+    }
+
     error_message = msg;
     if (jmp_ready)
         siglongjmp(env, 1);
@@ -4,16 +4,30 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * The allocation functions may be called from several threads at once.  The
+ * modes and exceptions below are meant to be driven by the main thread.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
+
+/* Same as test_malloc and test_strdup, recording the call site */
+void *test_malloc_at(size_t size,
+                     const char *file,
+                     int line,
+                     const char *func);
+char *test_strdup_at(const char *s,
+                     const char *file,
+                     int line,
+                     const char *func);
 /* FIXME: provide test_realloc as well */
 
 #ifdef INTERNAL
@@ -21,45 +35,167 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Number of size classes of alloc_site_t */
+#define ALLOC_SIZE_CLASSES 20
+
+/* Number of call sites told apart.  Below 256, so that slabs can keep the
+ * site of an object in a byte, with one value to spare
+ */
+#define ALLOC_SITES 255
+
+/*
+ * Allocations made at one call site.  Frees are charged to the site which
+ * allocated the block, so that live and peak are the bytes held by the
+ * blocks of this site.  sizes[i] counts allocations of at most 2^i bytes and
+ * more than half that, the last class also counts every larger one.  Slab
+ * pages are gathered under the "slabs" site, while the objects carved from
+ * them are charged to the site of slab_alloc() by the size of their slot.
+ * Allocations of unknown site are gathered under a NULL file.
+ */
+typedef struct {
+    const char *file;
+    const char *func;
+    int line;
+    size_t allocs, frees;
+    size_t bytes, live, peak;
+    size_t sizes[ALLOC_SIZE_CLASSES];
+} alloc_site_t;
+
+/* Copy the n sites which allocated the most bytes into top, most first.
+ * Return how many were copied
+ */
+size_t alloc_sites(alloc_site_t *top, size_t n);
+
+/* How much of the payload of allocated and freed blocks is filled with a
+ * junk byte: all of it, the first and last 64 bytes or none.  The magic
+ * words around the payload are checked in every mode.
+ */
+enum { POISON_FULL, POISON_EDGES, POISON_OFF };
+extern int poison_mode;
+
+/* Bytes of freed blocks held in quarantine instead of being released, none
+ * if 0.  Quarantined blocks are filled with a junk byte, and checked to be
+ * unchanged when they leave the quarantine, oldest first, to detect writes
+ * after free.  Freeing them again is reported as freeing an unallocated
+ * block.  Slab objects allocated meanwhile get blocks of their own, so that
+ * they are quarantined too.
+ */
+extern int quarantine_bytes;
+
+/* Release the oldest quarantined blocks until at most keep bytes are held.
+ * Return false if any of them was written after free
+ */
+bool quarantine_trim(size_t keep);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seed of the malloc failure generator, random if 0 */
+extern int fail_seed;
+
+/* Restart the malloc failure generator of every thread from fail_seed */
+void fail_reseed();
+
+/* Time budget of each time limited operation in milliseconds, none if 0.
+ * An operation overrunning it raises SIGALRM
+ */
+extern int budget_ms;
+
+/* Report in nanoseconds how long the last time limited operation took, and
+ * the longest one since the last reset
+ */
+void budget_usage(uint64_t *last_ns, uint64_t *peak_ns, bool reset);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
 void set_cautious_mode(bool cautious);
 
+/*
+ * Set/unset compact mode.
+ * Blocks normally take 20 bytes besides their payload, which is aligned as
+ * malloc aligns it.  In compact mode, they take 12 bytes and the payload is
+ * only 8-byte aligned.  Return false, leaving the mode as it is, if any block
+ * is still allocated.
+ */
+bool set_compact_mode(bool compact);
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
  */
 void set_noallocate_mode(bool noallocate);
 
+/*
+ * Slab support.
+ * A slab is a block exempt from failure injection, out of which the caller
+ * carves fixed-size objects.  Each carved object is accounted as a block of
+ * its own, so allocation_check(), failure injection and the call sites see
+ * one allocation per object, just as if it had been obtained from
+ * test_malloc.
+ */
+void *test_malloc_slab(size_t size);
+
+/* Account one object of size bytes carved from a slab, allocated at the
+ * given call site.  Return the index of the site, below ALLOC_SITES, or -1 if
+ * the allocation should fail
+ */
+int test_slab_claim(size_t size, const char *file, int line, const char *func);
+
+/* Account cnt objects of the site returned to their slabs, bytes in all */
+void test_slab_release(int site, size_t cnt, size_t bytes);
+
+/* Report an attempt to release an object that is not live */
+void test_slab_error(void *p);
+
+/* Bracket allocator code that must not be left half way.  An exception
+ * triggered in between is raised by the outermost alloc_leave
+ */
+void alloc_enter();
+void alloc_leave();
+
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Evaluates to true for initial return, false for error return.  A macro, as
+ * the frame calling sigsetjmp has to be live when the exception is raised
  */
-bool exception_setup(bool limit_time);
+#define exception_setup(limit_time)                      \
+    (sigsetjmp(*exception_env(), 1) ? exception_caught() \
+                                    : exception_armed(limit_time))
+
+/* Helpers of exception_setup */
+sigjmp_buf *exception_env();
+bool exception_caught();
+bool exception_armed(bool limit_time);
 
 /* Call once past risky code */
 void exception_cancel();
 
-/* Use longjmp to return to most recent exception setup.  Include error message
+/* Use longjmp to return to most recent exception setup.  Include error message.
+ * Inside the allocator, the exception is held back until alloc_leave.
  */
 void trigger_exception(char *msg);
 
 #else /* !INTERNAL */
 
-/* Tested program use our versions of malloc and free */
-#define malloc test_malloc
+/* Declare the library functions first, as the macros below would mangle
+ * their prototypes in headers included later
+ */
+#include <stdlib.h>
+#include <string.h>
+
+/* Tested program use our versions of malloc and free, which record where
+ * blocks are allocated
+ */
+#define malloc(size) test_malloc_at(size, __FILE__, __LINE__, __func__)
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) test_strdup_at(s, __FILE__, __LINE__, __func__)
 
 #endif
 
@@ -0,0 +1,54 @@
+/* Latency histogram */
+
+#include <time.h>
+
+#include "latency.h"
+
+void lat_record(lat_hist_t *h, uint64_t v)
+{
+    int idx = v;
+    if (v >= LAT_SUB) {
+        int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+        idx = LAT_SUB * (shift + 1) + (int) ((v >> shift) - LAT_SUB);
+    }
+    h->count[idx]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void lat_merge(lat_hist_t *dst, const lat_hist_t *src)
+{
+    for (int i = 0; i < LAT_BUCKETS; i++)
+        dst->count[i] += src->count[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t lat_percentile(const lat_hist_t *h, double p)
+{
+    uint64_t rank = (uint64_t) (p / 100 * h->total + 0.5), seen = 0;
+    if (!rank)
+        rank = 1;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen < rank)
+            continue;
+        if (i < LAT_SUB)
+            return i;
+        int shift = i / LAT_SUB - 1;
+        uint64_t top = ((uint64_t) (i % LAT_SUB + LAT_SUB + 1) << shift) - 1;
+        return top < h->max ? top : h->max;
+    }
+    return h->max;
+}
+
+uint64_t lat_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
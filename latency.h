@@ -0,0 +1,55 @@
+#ifndef LAB0_LATENCY_H
+#define LAB0_LATENCY_H
+
+/* Latency histogram.
+ *
+ * Values are counted in log-linear buckets, as in HdrHistogram: 16
+ * sub-buckets per power of two, so that any 64-bit value is recorded in
+ * constant time and space, within 1/16 of its magnitude.
+ */
+
+#include <stdint.h>
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (LAT_SUB * (64 - LAT_SUB_BITS + 1))
+
+typedef struct {
+    uint64_t count[LAT_BUCKETS];
+    uint64_t total; /* number of values */
+    uint64_t sum;
+    uint64_t max;
+} lat_hist_t;
+
+/**
+ * lat_record() - Count one value
+ * @h: histogram to count into
+ * @v: value
+ */
+void lat_record(lat_hist_t *h, uint64_t v);
+
+/**
+ * lat_merge() - Add the counts of a histogram to another
+ * @dst: histogram to add into
+ * @src: histogram to add
+ */
+void lat_merge(lat_hist_t *dst, const lat_hist_t *src);
+
+/**
+ * lat_percentile() - Estimate a percentile
+ * @h: histogram
+ * @p: percentile, between 0 and 100
+ *
+ * Return: the highest value of the bucket holding the @p-th percentile,
+ * capped by the maximum value
+ */
+uint64_t lat_percentile(const lat_hist_t *h, double p);
+
+/**
+ * lat_now_ns() - Read the monotonic clock
+ *
+ * Return: the time in nanoseconds
+ */
+uint64_t lat_now_ns(void);
+
+#endif /* LAB0_LATENCY_H */
@@ -0,0 +1,115 @@
+/* Lock-free multi-producer/multi-consumer queue of elements */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mpmc.h"
+
+/* Keep the counters of producers and consumers on separate cache lines */
+#define CACHE_LINE 64
+
+struct cell {
+    atomic_size_t seq;
+    element_t *e;
+};
+
+/* A cell at position pos is ready to be filled when its sequence number is
+ * pos, and to be emptied when it is pos + 1.  Emptying it sets it to the
+ * position it takes at the next lap, pos + mask + 1.
+ */
+struct mpmc {
+    atomic_size_t tail; /* next position to push at */
+    char pad0[CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t head; /* next position to pop from */
+    char pad1[CACHE_LINE - sizeof(atomic_size_t)];
+    size_t mask;
+    struct cell *cell;
+};
+
+mpmc_t *mpmc_new(size_t capacity)
+{
+    size_t cap = 2;
+    while (cap < capacity)
+        cap <<= 1;
+
+    mpmc_t *q = malloc(sizeof(mpmc_t));
+    if (!q)
+        return NULL;
+    q->cell = malloc(cap * sizeof(struct cell));
+    if (!q->cell) {
+        free(q);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&q->cell[i].seq, i);
+    q->mask = cap - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q)
+        return;
+
+    free(q->cell);
+    free(q);
+}
+
+bool mpmc_push(mpmc_t *q, element_t *e)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct cell *c;
+    for (;;) {
+        c = &q->cell[pos & q->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+        if (!dif) {
+            /* Claim the cell, or learn the position another producer
+             * moved to
+             */
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            /* Not emptied since the previous lap */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    c->e = e;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+element_t *mpmc_pop(mpmc_t *q)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct cell *c;
+    for (;;) {
+        c = &q->cell[pos & q->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (!dif) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            /* Not filled yet at this lap */
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    element_t *e = c->e;
+    atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+    return e;
+}
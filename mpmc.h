@@ -0,0 +1,62 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/* Lock-free multi-producer/multi-consumer queue of elements.
+ *
+ * This is the bounded ring of Dmitry Vyukov: every cell carries a sequence
+ * number telling whether it is ready to be filled or emptied at the current
+ * lap, and producers and consumers claim positions with a compare-and-swap
+ * of their own counter, so they never wait on each other.
+ *
+ * Cells are allocated once by mpmc_new() and reused lap after lap, hence no
+ * node is ever reclaimed while another thread may read it.  Elements are not
+ * owned by the queue: they are passed by pointer and the consumer popping an
+ * element is responsible for it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct mpmc mpmc_t;
+
+/**
+ * mpmc_new() - Create an empty queue
+ * @capacity: number of elements the queue can hold, rounded up to a power
+ *            of two
+ *
+ * Return: NULL for allocation failed
+ */
+mpmc_t *mpmc_new(size_t capacity);
+
+/**
+ * mpmc_free() - Free the queue, no effect if NULL
+ * @q: queue to free
+ *
+ * Elements still in the queue are not released.
+ */
+void mpmc_free(mpmc_t *q);
+
+/**
+ * mpmc_push() - Append an element at tail of queue
+ * @q: queue to push to
+ * @e: element to push, must not be NULL
+ *
+ * Safe to call from any number of threads at once.
+ *
+ * Return: true for success, false if queue is full
+ */
+bool mpmc_push(mpmc_t *q, element_t *e);
+
+/**
+ * mpmc_pop() - Remove the element at head of queue
+ * @q: queue to pop from
+ *
+ * Safe to call from any number of threads at once.
+ *
+ * Return: the element, %NULL if queue is empty
+ */
+element_t *mpmc_pop(mpmc_t *q);
+
+#endif /* LAB0_MPMC_H */
@@ -3,8 +3,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,12 +17,6 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#if defined(__APPLE__)
-#include <mach/mach_time.h>
-#else /* Assume POSIX environments */
-#include <time.h>
-#endif
-
 #include "dudect/fixture.h"
 #include "list.h"
 #include "list_sort.h"
@@ -46,6 +44,9 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "cqueue.h"
+#include "latency.h"
+#include "mpmc.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -54,7 +55,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -76,9 +76,33 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Whether rh/rt take the removed string over rather than copy it */
+static int take_string = 0;
+
+/* Whether allocated blocks drop the padding that aligns their payload */
+static int compact = 0;
+
+/* Sorting algorithm used by the sort command */
+typedef enum {
+    SORT_MERGE,
+    SORT_LSORT,
+    SORT_RADIX,
+} sort_algo_t;
+
+static const char *const sort_algo_names[] = {"merge", "lsort", "radix", NULL};
+static int sort_algo = SORT_MERGE;
+
+static const char *const poison_names[] = {"full", "edges", "off", NULL};
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+
+/* How many strings are handed to the bulk insertion functions at once */
+#define INSERT_BATCH 1024
+static char *insert_batch[INSERT_BATCH];
+static char randstr_pool[INSERT_BATCH][MAX_RANDSTR_LEN];
+
 /* For queue_insert and queue_remove */
 typedef enum {
     POS_TAIL,
@@ -102,9 +126,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -117,7 +138,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -198,8 +218,6 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
         return ok;
     }
 
-    char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -215,10 +233,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
 
     if (!current || !current->q)
         report(3, "Warning: Calling insert %s on null queue",
@@ -226,48 +242,79 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     error_check();
 
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
-                                        : q_insert_head(current->q, inserts);
-            if (rval) {
-                current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
-                char *cur_inserts = entry->value;
-                if (!cur_inserts) {
+        for (int r = 0; ok && r < reps;) {
+            /* Insert in batches through the bulk interface */
+            int n = reps - r < INSERT_BATCH ? reps - r : INSERT_BATCH;
+            for (int i = 0; i < n; i++) {
+                if (need_rand) {
+                    fill_rand_string(randstr_pool[i], MAX_RANDSTR_LEN);
+                    insert_batch[i] = randstr_pool[i];
+                } else {
+                    insert_batch[i] = inserts;
+                }
+            }
+            int cnt = pos == POS_TAIL
+                          ? q_insert_tail_n(current->q, insert_batch, n)
+                          : q_insert_head_n(current->q, insert_batch, n);
+            /* The count returned must match how much the queue grew */
+            int grown = q_size(current->q) - current->size;
+            if (cnt != grown) {
+                report(1, "ERROR: Inserted %d elements, but queue grew by %d",
+                       cnt, grown);
+                current->size += grown;
+                ok = false;
+                break;
+            }
+            current->size += cnt;
+            r += cnt;
+
+            /* Only sample the element inserted last and its neighbor */
+            if (cnt) {
+                q_iter_t it;
+                element_t *node = pos == POS_TAIL
+                                      ? q_iter_last(current->q, &it)
+                                      : q_iter_first(current->q, &it);
+                element_t *neighbor =
+                    pos == POS_TAIL ? q_iter_prev(&it) : q_iter_next(&it);
+                char *last = insert_batch[cnt - 1];
+                char *cur_inserts = node ? node->value : NULL;
+                if (!cur_inserts || strcmp(cur_inserts, last)) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
-                } else if (r == 0 && inserts == cur_inserts) {
+                } else if (cur_inserts == last) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (!q_intern && neighbor &&
+                           neighbor->value == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
                     ok = false;
                     break;
                 }
-                lasts = cur_inserts;
-            } else {
+            }
+
+            if (cnt < n) {
+                /* Skip the string whose insertion failed */
+                r++;
                 fail_count++;
                 if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
+                    report(2, "Insertion of %s failed", insert_batch[cnt]);
                 else {
                     report(1,
                            "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                           insert_batch[cnt], fail_count);
                     ok = false;
                 }
             }
             ok = ok && !error_check();
         }
+    } else if (current && current->q) {
+        /* The batch interrupted was inserted in part */
+        current->size = q_size(current->q);
     }
     exception_cancel();
 
@@ -348,18 +395,39 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (current && exception_setup(true))
-        re = pos == POS_TAIL
-                 ? q_remove_tail(current->q, removes, string_length + 1)
-                 : q_remove_head(current->q, removes, string_length + 1);
+    char *taken = NULL;
+    size_t taken_len = 0;
+    if (current && exception_setup(true)) {
+        if (take_string)
+            taken = pos == POS_TAIL ? q_take_tail(current->q, &taken_len)
+                                    : q_take_head(current->q, &taken_len);
+        else
+            re = pos == POS_TAIL
+                     ? q_remove_tail(current->q, removes, string_length + 1)
+                     : q_remove_head(current->q, removes, string_length + 1);
+    }
     exception_cancel();
 
-    bool is_null = re ? false : true;
+    bool is_null = !re && !taken;
+
+    if (taken) {
+        if (strlen(taken) != taken_len) {
+            report(1, "ERROR: Length %zu of taken string %s is wrong",
+                   taken_len, taken);
+            ok = false;
+        }
+        size_t len = taken_len < (size_t) string_length ? taken_len
+                                                        : string_length;
+        memcpy(removes, taken, len);
+        removes[len] = '\0';
+        q_release_string(taken);
+    }
 
     if (!is_null) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
-        q_release_element(re);
+        if (re)
+            q_release_element(re);
 
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
@@ -416,10 +484,149 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+static bool queue_remove_n(position_t pos, int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int n = 0;
+    if (!get_int(argv[1], &n) || n < 0) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove %s on empty queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    LIST_HEAD(removed);
+    int cnt = 0;
+    if (current && exception_setup(true))
+        cnt = pos == POS_TAIL ? q_remove_tail_n(current->q, &removed, n)
+                              : q_remove_head_n(current->q, &removed, n);
+    exception_cancel();
+
+    bool ok = true;
+    int expected = current && current->size < n ? current->size : n;
+    if (cnt != expected) {
+        report(1, "ERROR: Removed %d elements, but %d expected", cnt,
+               expected);
+        ok = false;
+    }
+
+    element_t *item, *tmp;
+    int released = 0;
+    list_for_each_entry_safe (item, tmp, &removed, list) {
+        q_release_element(item);
+        released++;
+    }
+    if (released != cnt) {
+        report(1, "ERROR: Removed %d elements, but %d were handed back", cnt,
+               released);
+        ok = false;
+    }
+    if (current)
+        current->size -= released;
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static inline bool do_rhn(int argc, char *argv[])
+{
+    return queue_remove_n(POS_HEAD, argc, argv);
+}
+
+static inline bool do_rtn(int argc, char *argv[])
+{
+    return queue_remove_n(POS_TAIL, argc, argv);
+}
+
+static int cmp_strp(const void *a, const void *b)
+{
+    return strcmp(**(char *const *const *) a, **(char *const *const *) b);
+}
+
+/* Delete every string appearing more than once with q_delete_dup_all(), and
+ * check against a copy of the queue, whose duplicates are found by sorting.
+ */
+static bool dedup_all()
+{
+    int n = q_size(current->q);
+    char **values = calloc(n + 1, sizeof(char *));
+    char ***order = malloc((n + 1) * sizeof(char **));
+    bool *dup = calloc(n + 1, sizeof(bool));
+    bool ok = values && order && dup;
+    int cnt = 0;
+    element_t *item;
+    q_iter_t it;
+    if (ok) {
+        q_for_each (item, it, current->q) {
+            values[cnt] = strdup(item->value);
+            if (!values[cnt]) {
+                ok = false;
+                break;
+            }
+            order[cnt] = &values[cnt];
+            cnt++;
+        }
+    }
+    if (!ok) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for duplicate "
+               "checking");
+        goto out;
+    }
+
+    if (exception_setup(true))
+        ok = q_delete_dup_all(current->q);
+    exception_cancel();
+
+    if (!ok) {
+        report(1, "ERROR: Could not delete duplicates of queue");
+        goto out;
+    }
+
+    qsort(order, n, sizeof(char **), cmp_strp);
+    for (int i = 1; i < n; i++) {
+        if (!strcmp(*order[i - 1], *order[i]))
+            dup[order[i - 1] - values] = dup[order[i] - values] = true;
+    }
+
+    item = q_iter_first(current->q, &it);
+    for (int i = 0; i < n && ok; i++) {
+        if (dup[i])
+            current->size--;
+        else if (item && !strcmp(item->value, values[i]))
+            item = q_iter_next(&it);
+        else
+            ok = false;
+    }
+    ok = ok && !item;
+    if (!ok)
+        report(1,
+               "ERROR: Duplicate strings are in queue or distinct strings are "
+               "not in queue in their original order");
+
+out:
+    for (int i = 0; i < cnt; i++)
+        free(values[i]);
+    free(values);
+    free(order);
+    free(dup);
+
+    q_show(3);
+    return ok && !error_check();
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool all = argc == 2 && !strcmp(argv[1], "all");
+    if (argc != 1 && !all) {
+        report(1, "%s takes no arguments or 'all'", argv[0]);
         return false;
     }
 
@@ -428,12 +635,16 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    if (all)
+        return dedup_all();
+
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
+    q_iter_t it;
 
     // Copy current->q to l_copy
-    if (current->q && !list_empty(current->q)) {
-        list_for_each_entry (item, current->q, list) {
+    if (current->q && q_size(current->q)) {
+        q_for_each (item, it, current->q) {
             size_t slen;
             tmp = malloc(sizeof(element_t));
             if (!tmp)
@@ -449,7 +660,7 @@ static bool do_dedup(int argc, char *argv[])
             list_add_tail(&tmp->list, &l_copy);
         }
         // Return false if the loop does not leave properly
-        if (&item->list != current->q) {
+        if (item) {
             list_for_each_entry_safe (item, tmp, &l_copy, list) {
                 free(item->value);
                 free(item);
@@ -475,7 +686,7 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
-    struct list_head *l_tmp = current->q->next;
+    element_t *l_tmp = q_iter_first(current->q, &it);
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry (item, &l_copy, list) {
@@ -487,16 +698,14 @@ static bool do_dedup(int argc, char *argv[])
         if (is_this_dup || is_next_dup) {
             // Update list size
             current->size--;
-        } else if (l_tmp != current->q &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
-            l_tmp = l_tmp->next;
+        } else if (l_tmp && strcmp(l_tmp->value, item->value) == 0)
+            l_tmp = q_iter_next(&it);
         else
             ok = false;
         is_this_dup = is_next_dup;
     }
     // All elements in new list should be traversed
-    ok = ok && l_tmp == current->q;
+    ok = ok && !l_tmp;
     if (!ok)
         report(1,
                "ERROR: Duplicate strings are in queue or distinct strings are "
@@ -580,6 +789,16 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Compare callback for list_sort(), priv optionally points to descend */
+int cmp(void *priv, const struct list_head *a, const struct list_head *b)
+{
+    element_t *a_ele = list_entry(a, element_t, list);  // get mother element
+    element_t *b_ele = list_entry(b, element_t, list);
+    if (priv && *(int *) priv)
+        return q_cmp(b_ele, a_ele);
+    return q_cmp(a_ele, b_ele);
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -587,6 +806,12 @@ bool do_sort(int argc, char *argv[])
         return false;
     }
 
+    /* list_sort() walks the list of elements directly */
+    if (sort_algo == SORT_LSORT && strcmp(q_backend, "list")) {
+        report(1, "ERROR: lsort needs the list implementation of queues");
+        return false;
+    }
+
     int cnt = 0;
     if (!current || !current->q)
         report(3, "Warning: Calling sort on null queue");
@@ -598,20 +823,43 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    /* Sorting may not allocate, so make room beforehand.  Without it, array
+     * based implementations fall back on a slower sort
+     */
+    if (cnt >= 2 && !q_reserve(current->q, cnt))
+        report(3, "Warning: Could not reserve room for sorting");
+
     set_noallocate_mode(true);
-    if (current && exception_setup(true))
-        q_sort(current->q, descend);
+    if (current && exception_setup(true)) {
+        sigset_t oldmask;
+        switch (sort_algo) {
+        case SORT_LSORT:
+            /* Like q_sort(), leave the list whole if time runs out */
+            q_alarm_block(&oldmask);
+            list_sort(&descend, current->q, cmp);
+            q_alarm_restore(&oldmask);
+            break;
+        case SORT_RADIX:
+            q_sort_radix(current->q, descend);
+            break;
+        default:
+            q_sort(current->q, descend);
+            break;
+        }
+    }
     exception_cancel();
     set_noallocate_mode(false);
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        q_iter_t it;
+        element_t *item = q_iter_first(current->q, &it);
+        element_t *next_item;
+        for (; item && --cnt; item = next_item) {
             /* Ensure each element in ascending/descending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
@@ -630,13 +878,6 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
-int cmp(void *priv, const struct list_head *a, const struct list_head *b)
-{
-    element_t *a_ele = list_entry(a, element_t, list);  // get mother element
-    element_t *b_ele = list_entry(b, element_t, list);
-    return strcmp(a_ele->value, b_ele->value) < 0 ? 0 : 1;
-}
-
 bool do_lsort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -656,19 +897,25 @@ bool do_lsort(int argc, char *argv[])
     error_check();
 
     set_noallocate_mode(true);
-    if (current && exception_setup(true))
+    if (current && exception_setup(true)) {
+        sigset_t oldmask;
+        q_alarm_block(&oldmask);
         list_sort(NULL, current->q, cmp);
+        q_alarm_restore(&oldmask);
+    }
     exception_cancel();
     set_noallocate_mode(false);
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        q_iter_t it;
+        element_t *item = q_iter_first(current->q, &it);
+        element_t *next_item;
+        for (; item && --cnt; item = next_item) {
             /* Ensure each element in ascending/descending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (strcmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
@@ -688,6 +935,394 @@ bool do_lsort(int argc, char *argv[])
 }
 
 
+static bool do_cmpstat(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    size_t total = q_cmp_stat.total, by_key = q_cmp_stat.by_key;
+    report(1, "Comparisons: %zu, settled by prefix key: %zu (%.1f%%)", total,
+           by_key, total ? 100.0 * by_key / total : 0.0);
+    q_cmp_stat.total = 0;
+    q_cmp_stat.by_key = 0;
+    return true;
+}
+
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    const q_intern_stat_t *st = &q_intern_stat;
+    report(1, "Interned strings: %zu, referenced by %zu elements", st->strings,
+           st->refs);
+    report(1, "String bytes: %zu instead of %zu, saved %zu", st->bytes,
+           st->ref_bytes, st->ref_bytes - st->bytes);
+    return true;
+}
+
+static bool do_budget(int argc, char *argv[])
+{
+    bool reset = argc == 2 && !strcmp(argv[1], "reset");
+    if (argc > 2 || (argc == 2 && !reset)) {
+        report(1, "%s takes an optional 'reset'", argv[0]);
+        return false;
+    }
+
+    uint64_t last, peak;
+    budget_usage(&last, &peak, reset);
+    if (budget_ms > 0)
+        report(1, "Last operation: %.3f ms (%.1f%% of %d ms), longest: %.3f ms "
+               "(%.1f%%)",
+               last / 1e6, last / 1e4 / budget_ms, budget_ms, peak / 1e6,
+               peak / 1e4 / budget_ms);
+    else
+        report(1, "Last operation: %.3f ms, longest: %.3f ms, no budget",
+               last / 1e6, peak / 1e6);
+    return true;
+}
+
+static bool do_allocstat(int argc, char *argv[])
+{
+    int n = 10;
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &n) || n <= 0))) {
+        report(1, "%s takes an optional positive number of sites", argv[0]);
+        return false;
+    }
+
+    alloc_site_t *top = malloc(n * sizeof(alloc_site_t));
+    if (!top) {
+        report(1, "ERROR: Could not allocate the site table");
+        return false;
+    }
+    size_t cnt = alloc_sites(top, n);
+
+    report(1, "%-36s %9s %9s %12s %10s %10s", "Site", "Allocs", "Frees",
+           "Bytes", "Live", "Peak");
+    for (size_t i = 0; i < cnt; i++) {
+        const alloc_site_t *s = &top[i];
+        char site[64];
+        if (!s->file)
+            snprintf(site, sizeof(site), "(unknown)");
+        else if (!s->line)
+            snprintf(site, sizeof(site), "%s", s->file);
+        else
+            snprintf(site, sizeof(site), "%s:%d %s", s->file, s->line,
+                     s->func);
+        report(1, "%-36s %9zu %9zu %12zu %10zu %10zu", site, s->allocs,
+               s->frees, s->bytes, s->live, s->peak);
+
+        /* Non-empty size classes, as upper bound:count */
+        char sizes[512];
+        int len = snprintf(sizes, sizeof(sizes), "    sizes:");
+        for (int c = 0; c < ALLOC_SIZE_CLASSES; c++) {
+            if (!s->sizes[c] || len >= (int) sizeof(sizes))
+                continue;
+            len += snprintf(sizes + len, sizeof(sizes) - len, " %s%zu:%zu",
+                            c == ALLOC_SIZE_CLASSES - 1 ? ">" : "<=",
+                            (size_t) 1 << (c - (c == ALLOC_SIZE_CLASSES - 1)),
+                            s->sizes[c]);
+        }
+        report(1, "%s", sizes);
+    }
+    free(top);
+    return true;
+}
+
+static void lat_report(const char *name, const lat_hist_t *h)
+{
+    report(1,
+           "%s latency (ns): p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64
+           ", p99.9 %" PRIu64 ", max %" PRIu64,
+           name, lat_percentile(h, 50), lat_percentile(h, 90),
+           lat_percentile(h, 99), lat_percentile(h, 99.9), h->max);
+}
+
+/* Thread of the mpmc command, a producer if elems is set */
+struct mpmc_worker {
+    pthread_t tid;
+    element_t **elems;
+    int n;
+    uintptr_t sum; /* addresses of the popped elements, added up */
+    lat_hist_t lat;
+};
+
+static mpmc_t *mpmc_q;
+static atomic_int mpmc_popped;
+static int mpmc_total;
+
+/* Start gate of the benchmark threads.  Unlike a barrier, it does not need
+ * to know beforehand how many threads will be created, so the threads
+ * already waiting can be sent home if one cannot be created.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready; /* threads waiting at the gate */
+    int state;      /* 0 while closed, 1 once open, -1 if aborted */
+    uint64_t start; /* time the gate opened, before any thread went through */
+} bench_gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0};
+
+/* Wait for the gate to open, return false if the benchmark is aborted */
+static bool bench_wait()
+{
+    pthread_mutex_lock(&bench_gate.lock);
+    bench_gate.ready++;
+    pthread_cond_broadcast(&bench_gate.cond);
+    while (!bench_gate.state)
+        pthread_cond_wait(&bench_gate.cond, &bench_gate.lock);
+    bool go = bench_gate.state > 0;
+    pthread_mutex_unlock(&bench_gate.lock);
+    return go;
+}
+
+/* Wait for the threads created to reach the gate, then open it if all
+ * of the wanted ones were created, or abort the benchmark otherwise
+ */
+static bool bench_open(int created, int wanted)
+{
+    pthread_mutex_lock(&bench_gate.lock);
+    while (bench_gate.ready < created)
+        pthread_cond_wait(&bench_gate.cond, &bench_gate.lock);
+    bench_gate.start = lat_now_ns();
+    bench_gate.state = created == wanted ? 1 : -1;
+    pthread_cond_broadcast(&bench_gate.cond);
+    pthread_mutex_unlock(&bench_gate.lock);
+    return created == wanted;
+}
+
+/* Close the gate again once every thread has been joined */
+static void bench_close()
+{
+    bench_gate.ready = 0;
+    bench_gate.state = 0;
+}
+
+/* Latencies count from the first attempt, so they include the time spent
+ * waiting for a full queue to drain or an empty one to fill
+ */
+static void *mpmc_producer(void *arg)
+{
+    struct mpmc_worker *w = arg;
+    if (!bench_wait())
+        return NULL;
+    for (int i = 0; i < w->n; i++) {
+        uint64_t t = lat_now_ns();
+        while (!mpmc_push(mpmc_q, w->elems[i]))
+            sched_yield();
+        lat_record(&w->lat, lat_now_ns() - t);
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg)
+{
+    struct mpmc_worker *w = arg;
+    if (!bench_wait())
+        return NULL;
+    while (atomic_load(&mpmc_popped) < mpmc_total) {
+        uint64_t t = lat_now_ns();
+        element_t *e;
+        while (!(e = mpmc_pop(mpmc_q))) {
+            if (atomic_load(&mpmc_popped) >= mpmc_total)
+                return NULL;
+            sched_yield();
+        }
+        lat_record(&w->lat, lat_now_ns() - t);
+        atomic_fetch_add(&mpmc_popped, 1);
+        w->sum += (uintptr_t) e;
+    }
+    return NULL;
+}
+
+#define MPMC_MAX_THREADS 64
+#define CQ_MAX_THREADS 16
+
+static bool do_mpmc(int argc, char *argv[])
+{
+    int producers, consumers, n, capacity = 1024;
+    if (argc < 4 || argc > 5 || !get_int(argv[1], &producers) ||
+        !get_int(argv[2], &consumers) || !get_int(argv[3], &n) ||
+        (argc == 5 && !get_int(argv[4], &capacity))) {
+        report(1, "%s needs arguments P C N [capacity]", argv[0]);
+        return false;
+    }
+    if (producers < 1 || consumers < 1 ||
+        producers + consumers > MPMC_MAX_THREADS || n < 1 || capacity < 1) {
+        report(1, "At most %d threads, and at least one element and one of "
+               "each kind", MPMC_MAX_THREADS);
+        return false;
+    }
+
+    /* Elements are built beforehand, the harness being single threaded */
+    element_t **elems = malloc(n * sizeof(element_t *));
+    struct mpmc_worker *w = calloc(producers + consumers, sizeof(*w));
+    slab_cache_t *cache = slab_cache_new();
+    mpmc_q = mpmc_new(capacity);
+    int built = 0;
+    uintptr_t sum = 0;
+    bool ok = elems && w && cache && mpmc_q;
+    for (; ok && built < n; built++) {
+        char buf[MAX_RANDSTR_LEN];
+        fill_rand_string(buf, sizeof(buf));
+        elems[built] = q_element_new(cache, buf);
+        if (!elems[built])
+            break;
+        sum += (uintptr_t) elems[built];
+    }
+    if (!ok || built < n) {
+        report(1, "ERROR: Could not allocate %d elements", n);
+        ok = false;
+        goto out;
+    }
+
+    atomic_store(&mpmc_popped, 0);
+    mpmc_total = n;
+    int created = 0;
+    for (int from = 0; created < producers + consumers; created++) {
+        int i = created;
+        if (i < producers) {
+            w[i].elems = elems + from;
+            w[i].n = n / producers + (i < n % producers);
+            from += w[i].n;
+        }
+        if (pthread_create(&w[i].tid, NULL,
+                           i < producers ? mpmc_producer : mpmc_consumer,
+                           &w[i]))
+            break;
+    }
+
+    bool started = bench_open(created, producers + consumers);
+    static lat_hist_t push, pop;
+    memset(&push, 0, sizeof(push));
+    memset(&pop, 0, sizeof(pop));
+    uintptr_t popped = 0;
+    for (int i = 0; i < created; i++) {
+        pthread_join(w[i].tid, NULL);
+        lat_merge(i < producers ? &push : &pop, &w[i].lat);
+        popped += w[i].sum;
+    }
+    double elapsed = (lat_now_ns() - bench_gate.start) / 1e9;
+    bench_close();
+    if (!started) {
+        report(1, "ERROR: Could only create %d of %d threads", created,
+               producers + consumers);
+        ok = false;
+        goto out;
+    }
+
+    if (pop.total != (uint64_t) n || popped != sum) {
+        report(1, "ERROR: %" PRIu64 " of %d elements popped, or not the ones "
+               "pushed", pop.total, n);
+        ok = false;
+    }
+    report(1, "%d producers, %d consumers, %d elements: %.3f s, %.2f Mops/s",
+           producers, consumers, n, elapsed, 2 * n / elapsed / 1e6);
+    lat_report("Push", &push);
+    lat_report("Pop", &pop);
+
+out:
+    for (int i = 0; i < built; i++)
+        q_release_element(elems[i]);
+    if (cache)
+        slab_cache_release(cache);
+    mpmc_free(mpmc_q);
+    free(w);
+    free(elems);
+    return ok;
+}
+
+/* Thread of the cqbench command */
+struct cq_worker {
+    pthread_t tid;
+    cqueue_t *q;
+    int n;
+};
+
+/* Insert and remove n times, so that the queue never runs dry for long */
+static void *cq_worker(void *arg)
+{
+    struct cq_worker *w = arg;
+    char buf[MAX_RANDSTR_LEN];
+    if (!bench_wait())
+        return NULL;
+    for (int i = 0; i < w->n; i++) {
+        if (!cq_insert_tail(w->q, "cqbench"))
+            continue;
+        while (!cq_remove_head(w->q, buf, sizeof(buf)))
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Run n insert/remove pairs with threads threads, return millions of
+ * operations per second or a negative value if the queue could not be
+ * allocated or some thread could not be created
+ */
+static double cq_run(bool two_lock, int threads, int n)
+{
+    struct cq_worker w[CQ_MAX_THREADS];
+    cqueue_t *q = cq_new(two_lock);
+    if (!q)
+        return -1;
+
+    int created = 0;
+    for (; created < threads; created++) {
+        w[created].q = q;
+        w[created].n = n / threads + (created < n % threads);
+        if (pthread_create(&w[created].tid, NULL, cq_worker, &w[created]))
+            break;
+    }
+    bool started = bench_open(created, threads);
+    for (int i = 0; i < created; i++)
+        pthread_join(w[i].tid, NULL);
+    double elapsed = (lat_now_ns() - bench_gate.start) / 1e9;
+    bench_close();
+
+    cq_free(q);
+    return started ? 2 * n / elapsed / 1e6 : -1;
+}
+
+static bool do_cqbench(int argc, char *argv[])
+{
+    int n, max_threads = CQ_MAX_THREADS;
+    if (argc < 2 || argc > 3 || !get_int(argv[1], &n) ||
+        (argc == 3 && !get_int(argv[2], &max_threads))) {
+        report(1, "%s needs arguments N [threads]", argv[0]);
+        return false;
+    }
+    if (n < 1 || max_threads < 1 || max_threads > CQ_MAX_THREADS) {
+        report(1, "At least one pair and 1 to %d threads", CQ_MAX_THREADS);
+        return false;
+    }
+
+    /* Every element is allocated and freed by the threads */
+    size_t allocated = allocation_check();
+    report(1, "Threads  Global lock  Two locks  (Mops/s)");
+    /* Powers of two, then max_threads */
+    for (int t = 0; t < max_threads;) {
+        t = t ? 2 * t : 1;
+        if (t > max_threads)
+            t = max_threads;
+        double global = cq_run(false, t, n), two = cq_run(true, t, n);
+        if (global < 0 || two < 0) {
+            report(1, "ERROR: Could not allocate queue or create threads");
+            return false;
+        }
+        report(1, "%7d  %11.2f  %9.2f", t, global, two);
+    }
+    if (allocation_check() != allocated) {
+        report(1, "ERROR: %zu blocks leaked or freed twice",
+               allocation_check() - allocated);
+        return false;
+    }
+    return !error_check();
+}
+
 static bool do_dm(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -768,11 +1403,13 @@ static bool do_ascend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+        q_iter_t it;
+        element_t *item = q_iter_first(current->q, &it);
+        element_t *next_item;
+        for (; item && --cnt; item = next_item) {
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (strcmp(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
@@ -815,11 +1452,13 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+        q_iter_t it;
+        element_t *item = q_iter_first(current->q, &it);
+        element_t *next_item;
+        for (; item && --cnt; item = next_item) {
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (strcmp(item->value, next_item->value) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
@@ -876,14 +1515,28 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
+    /* Make room for every element in the first queue, as merging may not
+     * allocate
+     */
     int len = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain)
+        len += q_size(ctx->q);
+    queue_contex_t *first =
+        list_first_entry(&chain.head, queue_contex_t, chain);
+    if (first->q && !q_reserve(first->q, len)) {
+        report(1, "ERROR: Could not reserve room for merging");
+        return false;
+    }
+
+    len = 0;
     set_noallocate_mode(true);
     if (current && exception_setup(true))
         len = q_merge(&chain.head, descend);
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -902,12 +1555,14 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --len; cur_l = cur_l->next) {
+        q_iter_t it;
+        element_t *item = q_iter_first(current->q, &it);
+        element_t *next_item;
+        for (; item && --len; item = next_item) {
             /* Ensure each element in ascending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
@@ -934,24 +1589,6 @@ static bool do_merge(int argc, char *argv[])
     return ok && !error_check();
 }
 
-static bool is_circular()
-{
-    struct list_head *cur = current->q->next;
-    while (cur != current->q) {
-        if (!cur)
-            return false;
-        cur = cur->next;
-    }
-
-    cur = current->q->prev;
-    while (cur != current->q) {
-        if (!cur)
-            return false;
-        cur = cur->prev;
-    }
-    return true;
-}
-
 static bool q_show(int vlevel)
 {
     bool ok = true;
@@ -964,19 +1601,19 @@ static bool q_show(int vlevel)
         return true;
     }
 
-    if (!is_circular()) {
+    if (!q_check(current->q)) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
     }
 
     report_noreturn(vlevel, "l = [");
 
-    struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    q_iter_t it;
+    element_t *e = NULL;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
+        e = q_iter_first(current->q, &it);
+        while (ok && e && cnt < current->size) {
             if (cnt < BIG_LIST_SIZE) {
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
                 if (show_entropy) {
@@ -986,7 +1623,7 @@ static bool q_show(int vlevel)
                 }
             }
             cnt++;
-            cur = cur->next;
+            e = q_iter_next(&it);
             ok = ok && !error_check();
         }
     }
@@ -997,7 +1634,7 @@ static bool q_show(int vlevel)
         return false;
     }
 
-    if (cur == ori) {
+    if (!e) {
         if (cnt <= BIG_LIST_SIZE)
             report(vlevel, "]");
         else
@@ -1071,6 +1708,61 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Restart the malloc failures from the new seed */
+static void seed_changed(int oldval)
+{
+    fail_reseed();
+}
+
+/* Release the blocks beyond the new quarantine size */
+static void quarantine_changed(int oldval)
+{
+    quarantine_trim(quarantine_bytes > 0 ? quarantine_bytes : 0);
+}
+
+/* The block layout can only change while no block is allocated */
+static void compact_changed(int oldval)
+{
+    if (!set_compact_mode(compact)) {
+        report(1, "Cannot change the block layout while blocks are "
+                  "allocated, free the queues first");
+        compact = oldval;
+    }
+}
+
+/* Sorting a single element with several threads makes no sense */
+static void parsort_changed(int oldval)
+{
+    if (q_sort_threshold < 2) {
+        report(1, "Minimum queue size for sorting with several threads must "
+                  "be at least 2");
+        q_sort_threshold = oldval;
+    }
+}
+
+/* The intern table is single threaded, so keep it apart from threads */
+static void intern_changed(int oldval)
+{
+    if (q_intern && q_sort_threads > 1) {
+        report(1, "Cannot intern strings with %d threads, set threads to 1",
+               q_sort_threads);
+        q_intern = oldval;
+    }
+}
+
+static void threads_changed(int oldval)
+{
+    if (q_sort_threads < 1 || q_sort_threads > SORT_MAX_THREADS) {
+        report(1, "Number of threads must be between 1 and %d",
+               SORT_MAX_THREADS);
+        q_sort_threads = oldval;
+    } else if (q_intern && q_sort_threads > 1) {
+        report(1, "Cannot use threads while interning strings, set intern "
+               "to 0");
+        q_sort_threads = oldval;
+    }
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1093,12 +1785,17 @@ static void console_init()
         rt,
         "Remove from tail of queue. Optionally compare to expected value str",
         "[str]");
+    ADD_COMMAND(rhn, "Remove n elements from head of queue at once", "n");
+    ADD_COMMAND(rtn, "Remove n elements from tail of queue at once", "n");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
-    ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
+    ADD_COMMAND(dedup,
+                "Delete all nodes that have duplicate string, adjacent or "
+                "anywhere with 'all'",
+                "[all]");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
     ADD_COMMAND(ascend,
@@ -1113,14 +1810,68 @@ static void console_init()
                 "[K]");
     ADD_COMMAND(
         lsort, "Sort queue in ascending order through Linux kernel method", "");
+    ADD_COMMAND(memstat,
+                "Show how many string bytes are saved by interning", "");
+    ADD_COMMAND(budget,
+                "Show how much of its time budget the last operation used, "
+                "and the longest one since reset",
+                "[reset]");
+    ADD_COMMAND(allocstat,
+                "Show the n call sites which allocated the most bytes "
+                "(default: 10)",
+                "[n]");
+    ADD_COMMAND(mpmc,
+                "Pass N elements from P producer to C consumer threads through "
+                "a lock-free queue of the given capacity (default: 1024)",
+                "P C N [capacity]");
+    ADD_COMMAND(cqbench,
+                "Compare the two-lock concurrent queue with a single global "
+                "lock, doing N insert/remove pairs with 1 to 'threads' "
+                "threads (default: 16)",
+                "N [threads]");
+    ADD_COMMAND(cmpstat,
+                "Show and reset the number of element comparisons, and how "
+                "many were settled by prefix keys",
+                "");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("failseed", &fail_seed,
+              "Seed of malloc failures, random if 0.  Setting it restarts "
+              "the sequence of failures",
+              seed_changed);
+    add_param_choice("poison", &poison_mode,
+                     "Fill of allocated and freed blocks: full, edges or off",
+                     poison_names, NULL);
+    add_param("budget_ms", &budget_ms,
+              "Time limit of each operation in milliseconds, none if 0", NULL);
+    add_param("quarantine", &quarantine_bytes,
+              "Bytes of freed blocks held back to detect writes after free, "
+              "none if 0",
+              quarantine_changed);
+    add_param("compact", &compact,
+              "Leave out the padding aligning allocated blocks to 16 bytes",
+              compact_changed);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param_choice("sortalgo", &sort_algo,
+                     "Algorithm of sort command: merge, lsort or radix",
+                     sort_algo_names, NULL);
+    add_param("intern", &q_intern,
+              "Intern inserted strings in a table shared by all queues",
+              intern_changed);
+    add_param("take", &take_string,
+              "Take removed strings over with q_take_head/q_take_tail", NULL);
+    add_param("threads", &q_sort_threads,
+              "Number of threads used by merge sort", threads_changed);
+    add_param("parsort", &q_sort_threshold,
+              "Minimum queue size for sorting with several threads",
+              parsort_changed);
+    add_param("prefixkey", &q_prefix_key,
+              "Compare elements by their 8-byte prefix key first", NULL);
 }
 
 /* Signal handlers */
@@ -1153,9 +1904,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
         while (chain.size > 0) {
@@ -1168,7 +1916,11 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+
+    if (!quarantine_trim(0)) {
+        report(1, "ERROR: Blocks were written after being freed");
+        return false;
+    }
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1222,26 +1974,6 @@ static bool sanity_check()
     return true;
 }
 
-uintptr_t os_random(uintptr_t seed)
-{
-    /* ASLR makes the address random */
-    uintptr_t x = (uintptr_t) &os_random ^ seed;
-#if defined(__APPLE__)
-    x ^= (uintptr_t) mach_absolute_time();
-#else
-    struct timespec time;
-    clock_gettime(CLOCK_MONOTONIC, &time);
-    x ^= (uintptr_t) time.tv_sec;
-    x ^= (uintptr_t) time.tv_nsec;
-#endif
-    /* Do a few randomization steps */
-    uintptr_t max = ((x ^ (x >> 17)) & 0x0F) + 1;
-    for (uintptr_t i = 0; i < max; i++)
-        x = random_shuffle(x);
-    assert(x);
-    return x;
-}
-
 #define BUFSIZE 256
 int main(int argc, char *argv[])
 {
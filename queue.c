@@ -1,5 +1,7 @@
 #include "queue.h"
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,15 +17,51 @@
 
 #define sortVer 1
 
+/* Queue header handed out by q_new()
+ * @head: head of the circular doubly-linked list of elements
+ * @size: number of elements currently linked into @head
+ * @cache: slab cache the elements of this queue are allocated from
+ * @mixed: whether elements of other queues have been moved into @head
+ *
+ * @head must stay in the first position: callers only ever see a pointer to
+ * it, and the queue functions recover the header with container_of().
+ * Every q_* function which links or unlinks elements keeps @size up to date,
+ * so that q_size() does not have to walk the list.
+ *
+ * As long as the queue is not @mixed and holds every live element of @cache,
+ * q_free() drops whole slabs instead of releasing elements one at a time.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    slab_cache_t *cache;
+    bool mixed;
+} queue_t;
+
+/* Get the sized header of a queue, as returned by q_new() */
+static inline queue_t *q_header(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+const char q_backend[] = "list";
 
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *new = malloc(sizeof(struct list_head));
+    queue_t *new = malloc(sizeof(queue_t));
     if (!new)
         return NULL;
-    INIT_LIST_HEAD(new);
-    return new;
+
+    new->cache = slab_cache_new();
+    if (!new->cache) {
+        free(new);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&new->head);
+    new->size = 0;
+    new->mixed = false;
+    return &new->head;
 }
 
 /* Free all storage used by queue */
@@ -32,11 +70,25 @@ void q_free(struct list_head *head)
     if (!head)
         return;
 
-    element_t *cur, *next;
-    list_for_each_entry_safe (cur, next, head, list)
-        q_release_element(cur);
+    queue_t *q = q_header(head);
+    /* Free the queue whole even if time runs out */
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    if (!q->mixed && !q_intern_stat.strings &&
+        slab_cache_live(q->cache) == (size_t) q->size) {
+        /* Every element of the cache is in this queue, and no element holds
+         * a reference to an interned string
+         */
+        slab_cache_drop(q->cache);
+    } else {
+        element_t *cur, *next;
+        list_for_each_entry_safe (cur, next, head, list)
+            q_release_element(cur);
+        slab_cache_release(q->cache);
+    }
 
-    free(head);
+    free(q);
+    q_alarm_restore(&oldmask);
 }
 
 
@@ -46,25 +98,12 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *new_node = malloc(sizeof(element_t));
-    /*malloc failure*/
+    element_t *new_node = q_element_new(q_header(head)->cache, s);
     if (!new_node)
         return false;
 
-    new_node->value = malloc(strlen(s) + 1);
-
-    /*duplicate string failure*/
-    if (!new_node->value) {
-        free(new_node);
-        return false;
-    }
-
-    if (strncpy(new_node->value, s, strlen(s) + 1) == NULL) {
-        q_release_element(new_node);
-        return false;
-    }
-
     list_add(&new_node->list, head);
+    q_header(head)->size++;
     return true;
 }
 
@@ -75,28 +114,54 @@ bool q_insert_tail(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *new_node = malloc(sizeof(element_t));
-    /* malloc failure*/
+    element_t *new_node = q_element_new(q_header(head)->cache, s);
     if (!new_node)
         return false;
 
-    new_node->value = malloc(strlen(s) + 1);
+    list_add_tail(&new_node->list, head);
+    q_header(head)->size++;
+    return true;
+}
 
-    /*duplicate string failure*/
-    if (!new_node->value) {
-        free(new_node);
-        return false;
-    }
 
-    if (strncpy(new_node->value, s, strlen(s) + 1) == NULL) {
-        q_release_element(new_node);
-        return false;
-    }
+/* Insert several elements at head of queue */
+int q_insert_head_n(struct list_head *head, char **sv, int n)
+{
+    if (!head)
+        return 0;
 
-    list_add_tail(&new_node->list, head);
-    return true;
+    /* Link every element as soon as it is built, so that none is lost if
+     * the time limit interrupts the batch
+     */
+    queue_t *q = q_header(head);
+    int cnt = 0;
+    for (; cnt < n; cnt++) {
+        element_t *new_node = q_element_new(q->cache, sv[cnt]);
+        if (!new_node)
+            break;
+        list_add(&new_node->list, head);
+        q->size++;
+    }
+    return cnt;
 }
 
+/* Insert several elements at tail of queue */
+int q_insert_tail_n(struct list_head *head, char **sv, int n)
+{
+    if (!head)
+        return 0;
+
+    queue_t *q = q_header(head);
+    int cnt = 0;
+    for (; cnt < n; cnt++) {
+        element_t *new_node = q_element_new(q->cache, sv[cnt]);
+        if (!new_node)
+            break;
+        list_add_tail(&new_node->list, head);
+        q->size++;
+    }
+    return cnt;
+}
 
 /* Remove an element from head of queue */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
@@ -106,12 +171,9 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 
     element_t *rm_node = list_first_entry(head, element_t, list);
     list_del(&rm_node->list);
+    q_header(head)->size--;
 
-    if (sp) {
-        strncpy(sp, rm_node->value, bufsize);
-        sp[bufsize - 1] =
-            '\0'; /* Ensure null-termination of the copied string*/
-    }
+    q_element_copy(rm_node, sp, bufsize);
     return rm_node;
 }
 
@@ -123,25 +185,137 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 
     element_t *rm_node = list_last_entry(head, element_t, list);
     list_del(&rm_node->list);
+    q_header(head)->size--;
 
-    if (sp) {
-        strncpy(sp, rm_node->value, bufsize);
-        sp[bufsize - 1] = '\0'; /*Ensure null-termination of the copied string*/
-    }
+    q_element_copy(rm_node, sp, bufsize);
     return rm_node;
 }
 
+/* Remove the element at head of queue, handing its string over */
+char *q_take_head(struct list_head *head, size_t *len)
+{
+    return q_element_take(q_remove_head(head, NULL, 0), len);
+}
+
+/* Remove the element at tail of queue, handing its string over */
+char *q_take_tail(struct list_head *head, size_t *len)
+{
+    return q_element_take(q_remove_tail(head, NULL, 0), len);
+}
+
+/* Find the node which has n nodes up to and including it from the head,
+ * walking from whichever end of the queue is closer
+ */
+static struct list_head *q_nth(struct list_head *head, int n)
+{
+    struct list_head *node;
+    int size = q_header(head)->size;
+    if (n <= size / 2) {
+        for (node = head; n; n--)
+            node = node->next;
+    } else {
+        for (node = head->prev; n < size; n++)
+            node = node->prev;
+    }
+    return node;
+}
+
+/* Remove several elements from head of queue */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n)
+{
+    if (!head || list_empty(head) || n <= 0)
+        return 0;
+
+    queue_t *q = q_header(head);
+    if (n > q->size)
+        n = q->size;
+
+    LIST_HEAD(cut);
+    list_cut_position(&cut, head, q_nth(head, n));
+    list_splice_tail(&cut, list);
+    q->size -= n;
+    return n;
+}
+
+/* Remove several elements from tail of queue */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int n)
+{
+    if (!head || list_empty(head) || n <= 0)
+        return 0;
+
+    queue_t *q = q_header(head);
+    if (n > q->size)
+        n = q->size;
+
+    LIST_HEAD(keep);
+    list_cut_position(&keep, head, q_nth(head, q->size - n));
+    list_splice_tail_init(head, list);
+    list_splice(&keep, head);
+    q->size -= n;
+    return n;
+}
+
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
 
-    int size = 0;
-    struct list_head *it;
-    list_for_each (it, head)
-        size++;
-    return size;
+    return q_header(head)->size;
+}
+
+/* Element at node, NULL once the walk is back to the head */
+static inline element_t *iterAt(q_iter_t *it, struct list_head *node)
+{
+    it->node = node;
+    return node == it->head ? NULL : list_entry(node, element_t, list);
+}
+
+element_t *q_iter_first(struct list_head *head, q_iter_t *it)
+{
+    if (!head)
+        return NULL;
+
+    it->head = head;
+    return iterAt(it, head->next);
+}
+
+element_t *q_iter_last(struct list_head *head, q_iter_t *it)
+{
+    if (!head)
+        return NULL;
+
+    it->head = head;
+    return iterAt(it, head->prev);
+}
+
+element_t *q_iter_next(q_iter_t *it)
+{
+    return iterAt(it, ((struct list_head *) it->node)->next);
+}
+
+element_t *q_iter_prev(q_iter_t *it)
+{
+    return iterAt(it, ((struct list_head *) it->node)->prev);
+}
+
+/* Check that the list is circular both ways */
+bool q_check(struct list_head *head)
+{
+    struct list_head *cur = head->next;
+    while (cur != head) {
+        if (!cur)
+            return false;
+        cur = cur->next;
+    }
+
+    cur = head->prev;
+    while (cur != head) {
+        if (!cur)
+            return false;
+        cur = cur->prev;
+    }
+    return true;
 }
 
 /* Delete the middle node in queue */
@@ -157,6 +331,7 @@ bool q_delete_mid(struct list_head *head)
     }
     list_del(front);
     q_release_element(container_of(front, element_t, list));
+    q_header(head)->size--;
     return true;
 }
 
@@ -166,6 +341,7 @@ bool q_delete_dup(struct list_head *head)
     if (!head || list_empty(head))
         return false;
 
+    queue_t *q = q_header(head);
     bool found = false;
     element_t *cur, *next;
     list_for_each_entry_safe (cur, next, head, list) {
@@ -173,18 +349,21 @@ bool q_delete_dup(struct list_head *head)
             if (found) {
                 list_del(&cur->list);
                 q_release_element(cur);
+                q->size--;
             }
             return true;
         }
 
-        if (strcmp(cur->value, next->value) == 0) {
+        if (q_cmp(cur, next) == 0) {
             list_del(&cur->list);
             q_release_element(cur);
+            q->size--;
             found = true;
         } else {
             if (found) {
                 list_del(&cur->list);
                 q_release_element(cur);
+                q->size--;
                 found = false;
             }
         }
@@ -193,6 +372,63 @@ bool q_delete_dup(struct list_head *head)
     return true;
 }
 
+/* Slot of the hash set used by q_delete_dup_all() */
+struct dedup_slot {
+    element_t *first; /* first element holding the string, NULL if unused */
+    uint32_t hash;
+    bool dup;
+};
+
+bool q_delete_dup_all(struct list_head *head)
+{
+    if (!head)
+        return false;
+    if (list_empty(head))
+        return true;
+
+    queue_t *q = q_header(head);
+
+    /* Keep the load factor at most 1/2 */
+    size_t cap = 2;
+    while (cap < 2 * (size_t) q->size)
+        cap <<= 1;
+    struct dedup_slot *set = malloc(cap * sizeof(*set));
+    if (!set)
+        return false;
+    memset(set, 0, cap * sizeof(*set));
+
+    /* Duplicates are set aside until the walk is over, so the slots may keep
+     * pointing to the first elements holding each string.
+     */
+    LIST_HEAD(dups);
+    element_t *cur, *next;
+    list_for_each_entry_safe (cur, next, head, list) {
+        uint32_t hash = q_str_hash(cur->value, cur->len);
+        size_t i = hash & (cap - 1);
+        while (set[i].first && (set[i].hash != hash ||
+                                strcmp(set[i].first->value, cur->value)))
+            i = (i + 1) & (cap - 1);
+
+        if (!set[i].first) {
+            set[i].first = cur;
+            set[i].hash = hash;
+            continue;
+        }
+        list_move(&cur->list, &dups);
+        q->size--;
+        if (!set[i].dup) {
+            list_move(&set[i].first->list, &dups);
+            q->size--;
+            set[i].dup = true;
+        }
+    }
+    free(set);
+
+    list_for_each_entry_safe (cur, next, &dups, list)
+        q_release_element(cur);
+    return true;
+}
+
 /* Swap every two adjacent nodes */
 void q_swap(struct list_head *head)
 {
@@ -228,94 +464,313 @@ void q_reverse(struct list_head *head)
 /* Reverse the nodes of the list k at a time */
 void q_reverseK(struct list_head *head, int k)
 {
-    if (!head)
+    if (!head || k < 2)
         return;
 
-    int group = q_size(head) / k;
-    struct list_head *cut;
+    /* Reverse each group in place by moving its nodes, one after the other,
+     * in front of it: the queue is walked only once.
+     */
+    struct list_head *prev = head;
+    for (int group = q_size(head) / k; group; group--) {
+        struct list_head *first = prev->next;
+        for (int i = 1; i < k; i++)
+            list_move(first->next, prev);
+        prev = first;
+    }
+}
 
-    LIST_HEAD(tmp);
-    LIST_HEAD(new_head);
+/* Compare two nodes in sorting order: negative if a goes first, zero if
+ * equal and positive if b goes first
+ */
+static inline int q_order(const struct list_head *a,
+                          const struct list_head *b,
+                          bool descend)
+{
+    const element_t *ea = list_entry(a, element_t, list);
+    const element_t *eb = list_entry(b, element_t, list);
+    return descend ? q_cmp(eb, ea) : q_cmp(ea, eb);
+}
 
-    while (group) {
-        int cnt = 0;
-        list_for_each (cut, head) {
-            if (cnt >= k)
+/* Merge two null-terminated sorted lists, "prev" links are not maintained.
+ * Take from a on equality, as a holds the earlier elements, to stay stable.
+ */
+static struct list_head *mergeSortedList(struct list_head *a,
+                                         struct list_head *b,
+                                         bool descend)
+{
+    struct list_head *head, **tail = &head;
+
+    for (;;) {
+        if (q_order(a, b, descend) <= 0) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
                 break;
-            cnt++;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
         }
-        list_cut_position(&tmp, head, cut->prev);
-        q_reverse(&tmp);
-        list_splice_tail_init(&tmp, &new_head);
-        group--;
     }
-    list_splice_init(&new_head, head);
+    return head;
 }
 
-static struct list_head *mergeSortedList(struct list_head *L,
-                                         struct list_head *R)
+/* Cut the natural run at the beginning of the null-terminated *list and
+ * return it, null-terminated.  A strictly descending run is reversed while
+ * cut, which keeps the sort stable.
+ */
+static struct list_head *cutRun(struct list_head **list,
+                                size_t *len,
+                                bool descend)
 {
-    struct list_head *head = L, *prev = NULL;
-    struct list_head **ptr = &head;
+    struct list_head *run = *list, *node = run->next;
+
+    *len = 1;
+    if (node && q_order(run, node, descend) > 0) {
+        run->next = NULL;
+        while (node && q_order(run, node, descend) > 0) {
+            struct list_head *next = node->next;
+            node->next = run;
+            run = node;
+            node = next;
+            (*len)++;
+        }
+    } else {
+        struct list_head *tail = run;
+        while (node && q_order(tail, node, descend) <= 0) {
+            tail = node;
+            node = node->next;
+            (*len)++;
+        }
+        tail->next = NULL;
+    }
 
-    while (L && R) {
-        if (strcmp(list_entry(L, element_t, list)->value,
-                   list_entry(R, element_t, list)->value) > 0) {
-            *ptr = R;
-            (*ptr)->prev = prev;
-            prev = R;
-            R = R->next;
-        } else {
-            *ptr = L;
-            (*ptr)->prev = prev;
-            prev = L;
-            L = L->next;
+    *list = node;
+    return run;
+}
+
+/* Bottom-up merge sort over natural runs of a null-terminated list.
+ *
+ * Runs are pushed on a stack of pending runs, and the two on top are merged
+ * as long as the lower one is not more than twice as long as the upper one.
+ * Pending lengths thus at least double towards the bottom of the stack, which
+ * bounds its depth by the number of bits in a size_t and keeps merges
+ * balanced, without any recursion or midpoint search.
+ */
+static struct list_head *sortList(struct list_head *list, bool descend)
+{
+    struct {
+        struct list_head *list;
+        size_t len;
+    } pending[sizeof(size_t) * 8];
+    int cnt = 0;
+
+    while (list) {
+        pending[cnt].list = cutRun(&list, &pending[cnt].len, descend);
+        cnt++;
+        while (cnt > 1 && pending[cnt - 2].len <= 2 * pending[cnt - 1].len) {
+            pending[cnt - 2].list = mergeSortedList(
+                pending[cnt - 2].list, pending[cnt - 1].list, descend);
+            pending[cnt - 2].len += pending[cnt - 1].len;
+            cnt--;
         }
-        ptr = &(*ptr)->next;
     }
+    while (cnt > 1) {
+        pending[cnt - 2].list = mergeSortedList(pending[cnt - 2].list,
+                                                pending[cnt - 1].list, descend);
+        cnt--;
+    }
+    return pending[0].list;
+}
 
-    *ptr = (struct list_head *) ((uintptr_t) R | (uintptr_t) L);
-    (*ptr)->prev = prev;
-    return head;
+/* Turn the null-terminated list back into a circular doubly-linked list */
+static void rebuildList(struct list_head *head, struct list_head *list)
+{
+    struct list_head *prev = head;
+    for (struct list_head *node = list; node; node = node->next) {
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
 }
 
+/* A contiguous segment of the list sorted by one thread */
+struct sort_task {
+    pthread_t tid;
+    bool threaded;
+    bool descend;
+    struct list_head *list;
+    q_cmp_stat_t stat;
+};
+
+static void *sortWorker(void *arg)
+{
+    struct sort_task *task = arg;
+    task->list = sortList(task->list, task->descend);
+    task->stat = q_cmp_stat;
+    return NULL;
+}
 
-static struct list_head *mergeSort(struct list_head *head)
+/* Sort the queue by splitting it into contiguous segments, sorting each of
+ * them on its own thread, and merging the sorted segments pairwise.
+ *
+ * Nothing is allocated.  The caller holds SIGALRM back, so a time limit
+ * expiring meanwhile is delivered once every thread has been joined, and the
+ * exception neither leaves threads working on the list nor leaves the list in
+ * pieces.
+ */
+static void sortParallel(struct list_head *head,
+                         int size,
+                         int threads,
+                         bool descend)
 {
-    if (!head || !head->next)
-        return head;
+    struct sort_task tasks[SORT_MAX_THREADS];
+    struct list_head *list = head->next;
+
+    head->prev->next = NULL;
 
-    struct list_head *mid = head, *fast = head;
+    for (int i = 0; i < threads; i++) {
+        int len = size / threads + (i < size % threads);
+        struct list_head *last = list;
+        while (--len)
+            last = last->next;
+        tasks[i].list = list;
+        tasks[i].descend = descend;
+        tasks[i].threaded = false;
+        list = last->next;
+        last->next = NULL;
+    }
 
-    while (fast && fast->next) {
-        mid = mid->next;
-        fast = fast->next->next;
+    /* Fall back to the calling thread if a thread cannot be created */
+    for (int i = 1; i < threads; i++) {
+        tasks[i].threaded =
+            !pthread_create(&tasks[i].tid, NULL, sortWorker, &tasks[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        if (!tasks[i].threaded)
+            tasks[i].list = sortList(tasks[i].list, descend);
+    }
+    for (int i = 1; i < threads; i++) {
+        if (!tasks[i].threaded)
+            continue;
+        pthread_join(tasks[i].tid, NULL);
+        q_cmp_stat.total += tasks[i].stat.total;
+        q_cmp_stat.by_key += tasks[i].stat.by_key;
     }
-    mid->prev->next = NULL;
 
-    return mergeSortedList(mergeSort(head), mergeSort(mid));
+    for (int width = 1; width < threads; width *= 2) {
+        for (int i = 0; i + width < threads; i += 2 * width) {
+            tasks[i].list = mergeSortedList(tasks[i].list,
+                                            tasks[i + width].list, descend);
+        }
+    }
+    rebuildList(head, tasks[0].list);
 }
 
 void q_sort(struct list_head *head, bool descend)
 {
-    if (!head || list_empty(head) || !head->next)
+    if (!head || list_empty(head) || list_is_singular(head))
         return;
 
-    /*cut circular list*/
-    head->prev->next = NULL;
-    head->next = mergeSort(head->next);
+    int size = q_header(head)->size;
+    int threads = q_sort_threads;
+    if (threads > SORT_MAX_THREADS)
+        threads = SORT_MAX_THREADS;
+    if (threads > size)
+        threads = size;
+
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    if (threads > 1 && size >= q_sort_threshold) {
+        sortParallel(head, size, threads, descend);
+    } else {
+        /* Cut circular list */
+        head->prev->next = NULL;
+        rebuildList(head, sortList(head->next, descend));
+    }
+    q_alarm_restore(&oldmask);
+}
+
+/* Buckets smaller than this are sorted by sortList() instead */
+#define RADIX_CUTOFF 32
+
+/* MSD radix sort of a null-terminated list of n nodes on byte depth of
+ * their prefix keys, knowing all of them share the bytes before it.
+ *
+ * Nodes are distributed to the tail of their bucket, so the relative order
+ * of equal strings is kept.  Byte 0 marks strings which ended before depth,
+ * and thus are all equal.  Ties on the whole key are left to sortList(),
+ * which bounds the recursion to the 8 bytes of the key.
+ *
+ * Return: the sorted list, with its last node stored in *tail
+ */
+static struct list_head *radixSort(struct list_head *list,
+                                   size_t n,
+                                   int depth,
+                                   bool descend,
+                                   struct list_head **tail)
+{
+    if (n < RADIX_CUTOFF || depth == 8) {
+        list = sortList(list, descend);
+        for (*tail = list; (*tail)->next; *tail = (*tail)->next)
+            ;
+        return list;
+    }
+
+    struct list_head *bucket[256], **bucket_tail[256];
+    size_t cnt[256] = {0};
+    int shift = 56 - 8 * depth;
+
+    for (int i = 0; i < 256; i++)
+        bucket_tail[i] = &bucket[i];
+    for (struct list_head *node = list; node; node = node->next) {
+        int b = (list_entry(node, element_t, list)->key >> shift) & 0xff;
+        *bucket_tail[b] = node;
+        bucket_tail[b] = &node->next;
+        cnt[b]++;
+    }
 
-    /*econstruct double-linked list*/
-    head->next->prev = head;
-    struct list_head *tail = head->next;
-    while (tail->next)
-        tail = tail->next;
+    struct list_head *sorted = NULL, **link = &sorted;
+    for (int i = 0; i < 256; i++) {
+        int b = descend ? 255 - i : i;
+        if (!cnt[b])
+            continue;
+
+        *bucket_tail[b] = NULL;
+        struct list_head *last;
+        if (b && cnt[b] > 1) {
+            *link = radixSort(bucket[b], cnt[b], depth + 1, descend, &last);
+        } else {
+            *link = bucket[b];
+            last = container_of(bucket_tail[b], struct list_head, next);
+        }
+        link = &last->next;
+        *tail = last;
+    }
+    return sorted;
+}
 
-    head->prev = tail;
-    tail->next = head;
+void q_sort_radix(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
 
-    if (descend)
-        q_reverse(head);
+    struct list_head *tail;
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    head->prev->next = NULL;
+    rebuildList(head, radixSort(head->next, q_header(head)->size, 0, descend,
+                                &tail));
+    q_alarm_restore(&oldmask);
 }
 
 
@@ -330,15 +785,15 @@ int q_ascend(struct list_head *head)
     element_t *front = list_entry(head->prev->prev, element_t, list);
 
     while (&front->list != head) {
-        if (strcmp(back->value, front->value) > 0) {
+        if (q_cmp(back, front) > 0) {
             /*back value > front value (strictly ascend): both move ahead one*/
             /*entry*/
             front = list_entry(front->list.prev, element_t, list);
             back = list_entry(back->list.prev, element_t, list);
         } else {
             list_del(&front->list);
-            free(front->value);
-            free(front);
+            q_release_element(front);
+            q_header(head)->size--;
             front = list_entry(back->list.prev, element_t, list);
         }
     }
@@ -356,44 +811,108 @@ int q_descend(struct list_head *head)
     element_t *front = list_entry(head->prev->prev, element_t, list);
 
     while (&front->list != head) {
-        if (strcmp(back->value, front->value) < 0) {
+        if (q_cmp(back, front) < 0) {
             front = list_entry(front->list.prev, element_t, list);
             back = list_entry(back->list.prev, element_t, list);
         } else {
             list_del(&front->list);
-            free(front->value);
-            free(front);
+            q_release_element(front);
+            q_header(head)->size--;
             front = list_entry(back->list.prev, element_t, list);
         }
     }
     return q_size(head);
 }
 
-/* for merging two list */
-void mergeTwoList(struct list_head *l1, struct list_head *l2, bool descend)
+/* Maximum number of queues merged in a single pass by q_merge() */
+#define MERGE_WAYS 256
+
+/* A sorted list consumed by the k-way merge: node is its next element and
+ * head its header, which also terminates it.  The prefix key of node is
+ * cached so that sifting does not touch the elements.  idx breaks ties, so
+ * that equal elements keep the order of the queues in the chain.
+ */
+struct merge_src {
+    struct list_head *node, *head;
+    uint64_t key;
+    int idx;
+};
+
+static inline void mergeAdvance(struct merge_src *src, struct list_head *node)
+{
+    src->node = node;
+    if (node != src->head)
+        src->key = list_entry(node, element_t, list)->key;
+}
+
+static inline bool mergeBefore(const struct merge_src *a,
+                               const struct merge_src *b,
+                               bool descend)
 {
-    if (!l1 || !l2)
-        return;
+    if (q_prefix_key && a->key != b->key) {
+        q_cmp_stat.total++;
+        q_cmp_stat.by_key++;
+        return descend ? a->key > b->key : a->key < b->key;
+    }
+
+    int order = q_order(a->node, b->node, descend);
+    return order < 0 || (order == 0 && a->idx < b->idx);
+}
+
+static void mergeSiftDown(struct merge_src *heap, int n, int i, bool descend)
+{
+    struct merge_src tmp = heap[i];
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n &&
+            mergeBefore(&heap[child + 1], &heap[child], descend))
+            child++;
+        if (!mergeBefore(&heap[child], &tmp, descend))
+            break;
+        heap[i] = heap[child];
+    }
+    heap[i] = tmp;
+}
+
+/* Merge n non-empty sorted lists into the empty list out with a binary heap
+ * keyed by their next elements.  Nodes are relinked into out as they are
+ * popped, and the headers of the sources are left stale.
+ */
+static void mergeHeap(struct merge_src *heap,
+                      int n,
+                      struct list_head *out,
+                      bool descend)
+{
+    struct list_head *tail = out;
+
+    for (int i = n / 2 - 1; i >= 0; i--)
+        mergeSiftDown(heap, n, i, descend);
 
-    LIST_HEAD(tmp);
+    while (n > 1) {
+        struct list_head *node = heap[0].node;
+        mergeAdvance(&heap[0], node->next);
+        tail->next = node;
+        node->prev = tail;
+        tail = node;
 
-    while (!list_empty(l1) && !list_empty(l2)) {
-        element_t *l1_entry = list_first_entry(l1, element_t, list);
-        element_t *l2_entry = list_first_entry(l2, element_t, list);
-        element_t *tmp_entry;
-        if (descend)
-            tmp_entry = strcmp(l1_entry->value, l2_entry->value) > 0 ? l1_entry
-                                                                     : l2_entry;
-        else
-            tmp_entry = strcmp(l1_entry->value, l2_entry->value) < 0 ? l1_entry
-                                                                     : l2_entry;
+        if (heap[0].node == heap[0].head)
+            heap[0] = heap[--n];
+        mergeSiftDown(heap, n, 0, descend);
+    }
 
-        list_move_tail(&tmp_entry->list, &tmp);
+    /* The last source is appended as a whole */
+    if (n) {
+        tail->next = heap[0].node;
+        heap[0].node->prev = tail;
+        tail = heap[0].head->prev;
     }
+    tail->next = out;
+    out->prev = tail;
+}
 
-    list_splice_tail_init(l1, &tmp);
-    list_splice_tail_init(l2, &tmp);
-    list_splice(&tmp, l1);
+/* Nothing to reserve, elements are linked */
+bool q_reserve(struct list_head *head, int n)
+{
+    return head;
 }
 
 /* Merge all the queues into one sorted queue, which is in ascending/descending
@@ -403,24 +922,59 @@ int q_merge(struct list_head *head, bool descend)
     if (!head || list_empty(head))
         return 0;
 
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
     if (list_is_singular(head))
-        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
-
-    int size = q_size(head);
-    int iter = (size & 1) ? (size >> 1) + 1 : size >> 1;
-
-    for (int i = 0; i < iter; i++) {
-        queue_contex_t *l1 = list_first_entry(head, queue_contex_t, chain);
-        queue_contex_t *l2 = list_entry(l1->chain.next, queue_contex_t, chain);
+        return q_size(first->q);
+
+    /* Queues are consumed in batches of MERGE_WAYS, which is a single pass
+     * unless the chain is longer.  Each later batch also consumes what was
+     * merged so far.
+     */
+    struct merge_src heap[MERGE_WAYS];
+    LIST_HEAD(merged);
+    int total = 0;
+    bool mixed = false;
+    struct list_head *it = head->next;
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    while (it != head) {
+        int n = 0;
+        if (!list_empty(&merged)) {
+            heap[n] = (struct merge_src){.head = &merged, .idx = n};
+            mergeAdvance(&heap[n++], merged.next);
+        }
+        while (it != head && n < MERGE_WAYS) {
+            queue_contex_t *ctx = list_entry(it, queue_contex_t, chain);
+            it = it->next;
+            if (!ctx->q || list_empty(ctx->q))
+                continue;
+
+            heap[n] = (struct merge_src){.head = ctx->q, .idx = n};
+            mergeAdvance(&heap[n++], ctx->q->next);
+            mixed |= ctx != first;
+            total += q_header(ctx->q)->size;
+        }
 
-        while (!list_empty(l1->q) && !list_empty(l2->q)) {
-            mergeTwoList(l1->q, l2->q, descend);
-            list_move_tail(&l2->chain, head);
+        LIST_HEAD(out);
+        if (n)
+            mergeHeap(heap, n, &out, descend);
+        INIT_LIST_HEAD(&merged);
+        list_splice(&out, &merged);
+    }
 
-            /*move to next pair of queues*/
-            l1 = list_entry(l1->chain.next, queue_contex_t, chain);
-            l2 = list_entry(l1->chain.next, queue_contex_t, chain);
-        }
+    /* Leave every queue but the first one empty */
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain) {
+        if (!ctx->q)
+            continue;
+        INIT_LIST_HEAD(ctx->q);
+        q_header(ctx->q)->size = 0;
     }
-    return q_size(head);
-}
\ No newline at end of file
+
+    list_splice(&merged, first->q);
+    q_header(first->q)->size = total;
+    if (mixed)
+        q_header(first->q)->mixed = true;
+    q_alarm_restore(&oldmask);
+    return total;
+}
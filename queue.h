@@ -7,24 +7,141 @@
  * It uses a circular doubly-linked list to represent the set of queue elements
  */
 
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "harness.h"
 #include "list.h"
+#include "slab.h"
 
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @key: first 8 bytes of the string as a big-endian integer, zero padded
+ * @data: inline storage for the string
  *
- * @value needs to be explicitly allocated and freed
+ * Elements created by the queue functions are a single allocation from the
+ * slab cache of their queue: the string is copied into @data right behind the
+ * list node and @value points at it.
+ * When interning is on, @data is left empty and @value points to a string of
+ * the intern table instead, see q_intern.
+ *
+ * @key orders elements the same way strcmp() orders their prefixes, so most
+ * comparisons are settled without dereferencing @value, see q_cmp().
+ *
+ * @len caches strlen(@value), set when the element is created.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t key;
+    size_t len;
+    char data[];
 } element_t;
 
+/**
+ * q_prefix_key - Whether q_cmp() compares prefix keys first, on by default
+ */
+extern int q_prefix_key;
+
+/**
+ * q_cmp_stat_t - Counters of element comparisons
+ * @total: number of calls to q_cmp()
+ * @by_key: number of calls settled by the prefix keys alone
+ */
+typedef struct {
+    size_t total;
+    size_t by_key;
+} q_cmp_stat_t;
+
+/* Counted separately by each thread, see q_sort() */
+extern _Thread_local q_cmp_stat_t q_cmp_stat;
+
+/**
+ * q_intern - Whether inserted strings are interned, off by default
+ *
+ * Interned strings are kept once in a hash table shared by all the queues and
+ * reference counted: inserting a string already in the table only takes one
+ * more reference, and releasing the last element holding it frees it.
+ * Toggling this only affects elements created afterwards.
+ *
+ * The table is not synchronized: interned elements must only be created and
+ * released by one thread at a time.  qtest refuses to intern strings while
+ * q_sort_threads is above 1.
+ */
+extern int q_intern;
+
+/**
+ * q_intern_stat_t - Usage of the intern table
+ * @strings: number of distinct strings in the table
+ * @refs: number of elements holding one of them
+ * @bytes: bytes taken by the strings, terminators included
+ * @ref_bytes: bytes the strings would take if each element had its own copy
+ */
+typedef struct {
+    size_t strings;
+    size_t refs;
+    size_t bytes;
+    size_t ref_bytes;
+} q_intern_stat_t;
+
+extern q_intern_stat_t q_intern_stat;
+
+/**
+ * q_intern_put() - Drop a reference to an interned string
+ * @s: string of the intern table
+ */
+void q_intern_put(char *s);
+
+/**
+ * q_key() - Compute the prefix key of a string
+ * @s: string to compute the key of
+ */
+static inline uint64_t q_key(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*s)
+            key |= (unsigned char) *s++;
+    }
+    return key;
+}
+
+/**
+ * q_cmp() - Compare the strings of two elements
+ * @a: first element
+ * @b: second element
+ *
+ * Elements must have been created by the queue functions, so that their
+ * prefix keys are filled in.  If the keys are equal and the last byte of the
+ * key is zero, both strings are shorter than 8 characters and equal.
+ * Otherwise both strings have the same first 8 characters, none of which is
+ * a null terminator, so only the remaining characters are compared.
+ *
+ * Return: an integer less than, equal to or greater than zero, as strcmp()
+ */
+static inline int q_cmp(const element_t *a, const element_t *b)
+{
+    q_cmp_stat.total++;
+    if (!q_prefix_key)
+        return strcmp(a->value, b->value);
+
+    if (a->key != b->key) {
+        q_cmp_stat.by_key++;
+        return a->key < b->key ? -1 : 1;
+    }
+    if (!(a->key & 0xff)) {
+        q_cmp_stat.by_key++;
+        return 0;
+    }
+    return strcmp(a->value + 8, b->value + 8);
+}
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -78,6 +195,35 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_n() - Insert several elements in the head
+ * @head: header of queue
+ * @sv: strings would be inserted
+ * @n: number of strings in @sv
+ *
+ * Same as calling q_insert_head() on sv[0], sv[1], ..., sv[n - 1] in turn,
+ * hence sv[n - 1] ends up first.  Every element is linked into the queue as
+ * soon as it is built, so that the queue stays consistent if the batch is
+ * interrupted.  On allocation failure, the elements built so far are
+ * inserted and the remaining strings are not.
+ *
+ * Return: the number of strings inserted, 0 if queue is NULL
+ */
+int q_insert_head_n(struct list_head *head, char **sv, int n);
+
+/**
+ * q_insert_tail_n() - Insert several elements at the tail
+ * @head: header of queue
+ * @sv: strings would be inserted
+ * @n: number of strings in @sv
+ *
+ * Same as calling q_insert_tail() on sv[0], sv[1], ..., sv[n - 1] in turn.
+ * See q_insert_head_n() for the behavior on allocation failure.
+ *
+ * Return: the number of strings inserted, 0 if queue is NULL
+ */
+int q_insert_tail_n(struct list_head *head, char **sv, int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -86,6 +232,7 @@ bool q_insert_tail(struct list_head *head, char *s);
  *
  * If sp is non-NULL and an element is removed, copy the removed string to *sp
  * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * The rest of *sp is left untouched.
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
@@ -108,22 +255,229 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_take_head() - Remove the element from head of queue and hand its string
+ *                 over to the caller
+ * @head: header of queue
+ * @len: if non-NULL, receives the length of the string
+ *
+ * Nothing is copied: the string returned is the one stored in the removed
+ * element, which lives until the caller passes it to q_release_string().
+ * An interned string is handed over with the reference of the element, which
+ * is released at once.
+ *
+ * Return: the string of the removed element, %NULL if queue is NULL or empty.
+ */
+char *q_take_head(struct list_head *head, size_t *len);
+
+/**
+ * q_take_tail() - Remove the element from tail of queue and hand its string
+ *                 over to the caller
+ * @head: header of queue
+ * @len: if non-NULL, receives the length of the string
+ *
+ * Return: the string of the removed element, %NULL if queue is NULL or empty.
+ */
+char *q_take_tail(struct list_head *head, size_t *len);
+
+/**
+ * q_remove_head_n() - Remove several elements from head of queue
+ * @head: header of queue
+ * @list: list receiving the removed elements
+ * @n: number of elements to remove
+ *
+ * Up to @n elements are unlinked from the head of the queue and appended to
+ * @list, keeping their order.  As with q_remove_head(), the elements are not
+ * freed.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n);
+
+/**
+ * q_remove_tail_n() - Remove several elements from tail of queue
+ * @head: header of queue
+ * @list: list receiving the removed elements
+ * @n: number of elements to remove
+ *
+ * Same as q_remove_head_n(), but the last @n elements are removed.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int n);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
- * This function is intended for internal use only.
+ * This function is intended for internal use only, on elements created by
+ * the queue functions.
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
-    test_free(e);
+    if (e->value != e->data)
+        q_intern_put(e->value);
+    slab_free(e);
+}
+
+/**
+ * q_release_string() - Release a string returned by q_take_head() or
+ *                      q_take_tail(), together with its element
+ * @s: string would be released
+ */
+void q_release_string(char *s);
+
+/**
+ * q_str_hash() - Hash a string with 32-bit FNV-1a
+ * @s: string to hash
+ * @len: length of @s
+ */
+static inline uint32_t q_str_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
 }
 
+/**
+ * q_element_new_at() - Create an element holding a string
+ * @cache: slab cache to allocate the element from
+ * @s: string would be held
+ * @file: file of the call site, as accounted by the harness
+ * @line: line of the call site
+ * @func: function of the call site
+ *
+ * The string is copied into the element, or interned if q_intern is set.
+ * This function is intended for the queue implementations only, through
+ * q_element_new() which charges the element to the queue function calling it.
+ *
+ * Return: the new element, %NULL on allocation failure.
+ */
+element_t *q_element_new_at(slab_cache_t *cache,
+                            const char *s,
+                            const char *file,
+                            int line,
+                            const char *func);
+
+#define q_element_new(cache, s) \
+    q_element_new_at(cache, s, __FILE__, __LINE__, __func__)
+
+/**
+ * q_element_copy() - Copy the string of an element, as q_remove_head() does
+ * @e: element to copy the string of
+ * @sp: buffer receiving the string, may be NULL
+ * @bufsize: size of @sp
+ */
+void q_element_copy(const element_t *e, char *sp, size_t bufsize);
+
+/**
+ * q_element_take() - Hand the string of a removed element over, as
+ *                    q_take_head() does
+ * @e: element removed from its queue, may be NULL
+ * @len: if non-NULL, receives the length of the string
+ *
+ * Return: the string of @e, %NULL if @e is NULL.
+ */
+char *q_element_take(element_t *e, size_t *len);
+
+/**
+ * q_alarm_block() - Hold back the time limit while a queue is relinked
+ * @oldmask: receives the signal mask to pass to q_alarm_restore()
+ *
+ * SIGALRM is blocked in the calling thread, so that an operation running out
+ * of time fails once the queue is whole again rather than leaving it in
+ * pieces.  The price is that such a section cannot be cut short.
+ */
+void q_alarm_block(sigset_t *oldmask);
+
+/**
+ * q_alarm_restore() - Deliver a time limit held back by q_alarm_block()
+ * @oldmask: signal mask saved by q_alarm_block()
+ */
+void q_alarm_restore(const sigset_t *oldmask);
+
+/**
+ * q_backend - Name of the queue implementation built in, selected with the
+ *             QUEUE variable of the Makefile
+ */
+extern const char q_backend[];
+
+/**
+ * q_iter_t - Position of an element in a queue
+ * @head: header of queue
+ * @node: where the element is, meaning depends on the implementation
+ * @idx: where the element is, meaning depends on the implementation
+ *
+ * Iterating lets callers read queues without knowing how each implementation
+ * lays elements out.  The queue must not be modified meanwhile.
+ */
+typedef struct {
+    struct list_head *head;
+    void *node;
+    int idx;
+} q_iter_t;
+
+/**
+ * q_iter_first() - Get the element at head of queue
+ * @head: header of queue
+ * @it: receives the position of the element
+ *
+ * Return: the first element, %NULL if queue is NULL or empty.
+ */
+element_t *q_iter_first(struct list_head *head, q_iter_t *it);
+
+/**
+ * q_iter_last() - Get the element at tail of queue
+ * @head: header of queue
+ * @it: receives the position of the element
+ *
+ * Return: the last element, %NULL if queue is NULL or empty.
+ */
+element_t *q_iter_last(struct list_head *head, q_iter_t *it);
+
+/**
+ * q_iter_next() - Step to the next element
+ * @it: position of the current element, updated
+ *
+ * Return: the next element, %NULL past the tail of queue.
+ */
+element_t *q_iter_next(q_iter_t *it);
+
+/**
+ * q_iter_prev() - Step to the previous element
+ * @it: position of the current element, updated
+ *
+ * Return: the previous element, %NULL past the head of queue.
+ */
+element_t *q_iter_prev(q_iter_t *it);
+
+/**
+ * q_for_each() - Iterate over the elements of queue, from head to tail
+ * @e: element_t pointer used as iterator
+ * @it: q_iter_t used to hold the position of @e
+ * @head: header of queue
+ */
+#define q_for_each(e, it, head) \
+    for (e = q_iter_first(head, &(it)); e; e = q_iter_next(&(it)))
+
+/**
+ * q_check() - Check the links of queue
+ * @head: header of queue
+ *
+ * Return: true if every element can be reached from both ends of queue.
+ */
+bool q_check(struct list_head *head);
+
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The size is read from the queue header in constant time, so @head must have
+ * been created by q_new().
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -155,6 +509,20 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_all() - Delete all nodes whose string appears more than once,
+ *                      wherever they are in the queue
+ * @head: header of queue
+ *
+ * Unlike q_delete_dup(), the queue needs not be sorted.  It is walked once
+ * with a hash set of the strings met so far, and the remaining nodes keep
+ * their relative order.
+ *
+ * Return: true for success, false if list is NULL or the hash set could not
+ * be allocated.
+ */
+bool q_delete_dup_all(struct list_head *head);
+
 /**
  * q_swap() - Swap every two adjacent nodes
  * @head: header of queue
@@ -190,6 +558,18 @@ void q_reverse(struct list_head *head);
  */
 void q_reverseK(struct list_head *head, int k);
 
+/**
+ * q_sort_threads - Number of threads used by q_sort(), 1 by default, from 1
+ *                  to SORT_MAX_THREADS
+ * q_sort_threshold - Minimum queue size for q_sort() to use several threads,
+ *                    at least 2
+ */
+extern int q_sort_threads;
+extern int q_sort_threshold;
+
+/* Upper bound of q_sort_threads, which sizes the arrays on the stack */
+#define SORT_MAX_THREADS 64
+
 /**
  * q_sort() - Sort elements of queue in ascending/descending order
  * @head: header of queue
@@ -197,9 +577,25 @@ void q_reverseK(struct list_head *head, int k);
  *
  * No effect if queue is NULL or empty. If there has only one element, do
  * nothing.
+ *
+ * Queues of at least q_sort_threshold elements are split into q_sort_threads
+ * contiguous segments, sorted in parallel and merged.  Comparisons made by
+ * the other threads are added to q_cmp_stat of the calling thread.
  */
 void q_sort(struct list_head *head, bool descend);
 
+/**
+ * q_sort_radix() - Sort elements of queue with an MSD radix sort
+ * @head: header of queue
+ * @descend: whether or not to sort in descending order
+ *
+ * Same result as q_sort(), including the order of equal elements, but
+ * elements are distributed by the bytes of their prefix keys instead of
+ * being compared, which suits queues of short strings.  Small buckets and
+ * strings sharing their whole prefix key are sorted by comparison.
+ */
+void q_sort_radix(struct list_head *head, bool descend);
+
 /**
  * q_ascend() - Remove every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -250,4 +646,19 @@ int q_descend(struct list_head *head);
  */
 int q_merge(struct list_head *head, bool descend);
 
+/**
+ * q_reserve() - Make room for elements ahead of an operation that may not
+ *               allocate
+ * @head: header of queue
+ * @n: number of elements queue should be able to hold
+ *
+ * q_merge() moves every element into the first queue without allocating,
+ * so implementations storing elements in an array need the room beforehand.
+ * The same goes for any scratch space q_sort() and q_merge() sort through.
+ * Linked implementations have nothing to do.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_reserve(struct list_head *head, int n);
+
 #endif /* LAB0_QUEUE_H */
@@ -0,0 +1,835 @@
+/* Ring buffer implementation of the queue
+ *
+ * Elements are referenced from a circular array of pointers which doubles
+ * whenever it is full, so inserting and removing at either end only touch
+ * the array and the position of an element is a plain index.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+const char q_backend[] = "ring";
+
+/* Capacity of the array of a new queue, a power of two */
+#define RING_MIN 16
+
+/* Elements sorted by insertion before runs are merged */
+#define RING_RUN 16
+
+/* Queue header handed out by q_new()
+ * @head: list head handed out as the queue, always empty
+ * @buf: @cap pointers, the ring
+ * @cap: capacity of the ring, a power of two
+ * @scratch: @scratch_cap pointers, NULL until the queue is sorted or merged
+ * @first: index in the ring of the element at head of queue
+ * @size: number of elements in the ring
+ * @cache: slab cache the elements of this queue are allocated from
+ * @mixed: whether elements of other queues have been moved into this one
+ *
+ * Sorting and merging move the pointers through the scratch area.  As they
+ * are not allowed to allocate, q_reserve() allocates it beforehand, and it is
+ * kept for the next sort until the ring grows, so that queues which are never
+ * sorted or merged do not pay for it.
+ */
+typedef struct {
+    struct list_head head;
+    element_t **buf;
+    int cap;
+    element_t **scratch;
+    int scratch_cap;
+    int first;
+    int size;
+    slab_cache_t *cache;
+    bool mixed;
+} queue_t;
+
+/* Get the sized header of a queue, as returned by q_new() */
+static inline queue_t *q_header(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/* Slot of the i-th element from head of queue */
+static inline element_t **ringAt(queue_t *q, int i)
+{
+    return &q->buf[(q->first + i) & (q->cap - 1)];
+}
+
+/* Make the scratch area hold at least n pointers */
+static bool ringScratch(queue_t *q, int n)
+{
+    if (q->scratch_cap >= n)
+        return true;
+
+    element_t **scratch = malloc(n * sizeof(*scratch));
+    if (!scratch)
+        return false;
+    free(q->scratch);
+    q->scratch = scratch;
+    q->scratch_cap = n;
+    return true;
+}
+
+/* Copy the elements of queue, in order, to dst */
+static void ringCopyOut(queue_t *q, element_t **dst)
+{
+    int n = q->cap - q->first;
+    if (n > q->size)
+        n = q->size;
+    memcpy(dst, &q->buf[q->first], n * sizeof(*dst));
+    memcpy(dst + n, q->buf, (q->size - n) * sizeof(*dst));
+}
+
+/* Grow the ring to hold at least n elements */
+static bool ringGrow(queue_t *q, int n)
+{
+    int cap = q->cap;
+    while (cap < n)
+        cap <<= 1;
+    if (cap == q->cap)
+        return true;
+
+    element_t **buf = malloc(cap * sizeof(*buf));
+    if (!buf)
+        return false;
+    ringCopyOut(q, buf);
+
+    /* Switch to the new ring before freeing anything, so that a time limit
+     * expiring meanwhile leaves a consistent queue.  The scratch area is too
+     * small for the grown ring anyway.
+     */
+    element_t **old = q->buf, **scratch = q->scratch;
+    q->buf = buf;
+    q->cap = cap;
+    q->first = 0;
+    q->scratch = NULL;
+    q->scratch_cap = 0;
+    free(old);
+    free(scratch);
+    return true;
+}
+
+static inline void ringSwap(element_t **a, element_t **b)
+{
+    element_t *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *new = malloc(sizeof(queue_t));
+    if (!new)
+        return NULL;
+
+    new->buf = malloc(RING_MIN * sizeof(*new->buf));
+    if (!new->buf) {
+        free(new);
+        return NULL;
+    }
+    new->cache = slab_cache_new();
+    if (!new->cache) {
+        free(new->buf);
+        free(new);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&new->head);
+    new->cap = RING_MIN;
+    new->scratch = NULL;
+    new->scratch_cap = 0;
+    new->first = 0;
+    new->size = 0;
+    new->mixed = false;
+    return &new->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = q_header(head);
+    /* Free the queue whole even if time runs out */
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    if (!q->mixed && !q_intern_stat.strings &&
+        slab_cache_live(q->cache) == (size_t) q->size) {
+        /* Every element of the cache is in this queue, and no element holds
+         * a reference to an interned string
+         */
+        slab_cache_drop(q->cache);
+    } else {
+        for (int i = 0; i < q->size; i++)
+            q_release_element(*ringAt(q, i));
+        slab_cache_release(q->cache);
+    }
+    free(q->buf);
+    free(q->scratch);
+    free(q);
+    q_alarm_restore(&oldmask);
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = q_header(head);
+    element_t *new_node = q_element_new(q->cache, s);
+    if (!new_node)
+        return false;
+
+    if (q->size == q->cap && !ringGrow(q, q->size + 1)) {
+        q_release_element(new_node);
+        return false;
+    }
+    q->first = (q->first - 1) & (q->cap - 1);
+    q->buf[q->first] = new_node;
+    q->size++;
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = q_header(head);
+    element_t *new_node = q_element_new(q->cache, s);
+    if (!new_node)
+        return false;
+
+    if (q->size == q->cap && !ringGrow(q, q->size + 1)) {
+        q_release_element(new_node);
+        return false;
+    }
+    *ringAt(q, q->size++) = new_node;
+    return true;
+}
+
+/* Insert several elements at head of queue */
+int q_insert_head_n(struct list_head *head, char **sv, int n)
+{
+    if (!head)
+        return 0;
+
+    /* Grow once for all, a failure is handled by the single inserts */
+    ringGrow(q_header(head), q_size(head) + n);
+    int cnt = 0;
+    while (cnt < n && q_insert_head(head, sv[cnt]))
+        cnt++;
+    return cnt;
+}
+
+/* Insert several elements at tail of queue */
+int q_insert_tail_n(struct list_head *head, char **sv, int n)
+{
+    if (!head)
+        return 0;
+
+    ringGrow(q_header(head), q_size(head) + n);
+    int cnt = 0;
+    while (cnt < n && q_insert_tail(head, sv[cnt]))
+        cnt++;
+    return cnt;
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !q_size(head))
+        return NULL;
+
+    queue_t *q = q_header(head);
+    element_t *rm_node = q->buf[q->first];
+    q->first = (q->first + 1) & (q->cap - 1);
+    q->size--;
+
+    q_element_copy(rm_node, sp, bufsize);
+    return rm_node;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !q_size(head))
+        return NULL;
+
+    queue_t *q = q_header(head);
+    element_t *rm_node = *ringAt(q, --q->size);
+
+    q_element_copy(rm_node, sp, bufsize);
+    return rm_node;
+}
+
+/* Remove the element at head of queue, handing its string over */
+char *q_take_head(struct list_head *head, size_t *len)
+{
+    return q_element_take(q_remove_head(head, NULL, 0), len);
+}
+
+/* Remove the element at tail of queue, handing its string over */
+char *q_take_tail(struct list_head *head, size_t *len)
+{
+    return q_element_take(q_remove_tail(head, NULL, 0), len);
+}
+
+/* Remove several elements from head of queue */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n)
+{
+    int cnt = 0;
+    element_t *e;
+    while (cnt < n && (e = q_remove_head(head, NULL, 0))) {
+        list_add_tail(&e->list, list);
+        cnt++;
+    }
+    return cnt;
+}
+
+/* Remove several elements from tail of queue */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int n)
+{
+    LIST_HEAD(removed);
+    int cnt = 0;
+    element_t *e;
+    while (cnt < n && (e = q_remove_tail(head, NULL, 0))) {
+        list_add(&e->list, &removed);
+        cnt++;
+    }
+    list_splice_tail(&removed, list);
+    return cnt;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    return q_header(head)->size;
+}
+
+/* Element i of the queue of it, NULL once i went past either end */
+static inline element_t *iterAt(q_iter_t *it, int i)
+{
+    queue_t *q = q_header(it->head);
+    it->idx = i;
+    return i >= 0 && i < q->size ? *ringAt(q, i) : NULL;
+}
+
+element_t *q_iter_first(struct list_head *head, q_iter_t *it)
+{
+    if (!head)
+        return NULL;
+
+    it->head = head;
+    it->node = NULL;
+    return iterAt(it, 0);
+}
+
+element_t *q_iter_last(struct list_head *head, q_iter_t *it)
+{
+    if (!head)
+        return NULL;
+
+    it->head = head;
+    it->node = NULL;
+    return iterAt(it, q_size(head) - 1);
+}
+
+element_t *q_iter_next(q_iter_t *it)
+{
+    return iterAt(it, it->idx + 1);
+}
+
+element_t *q_iter_prev(q_iter_t *it)
+{
+    return iterAt(it, it->idx - 1);
+}
+
+/* Check that the ring is consistent and holds size elements */
+bool q_check(struct list_head *head)
+{
+    if (head->next != head || head->prev != head)
+        return false;
+
+    queue_t *q = q_header(head);
+    if (q->cap < RING_MIN || (q->cap & (q->cap - 1)) || q->first < 0 ||
+        q->first >= q->cap || q->size < 0 || q->size > q->cap)
+        return false;
+    for (int i = 0; i < q->size; i++) {
+        if (!*ringAt(q, i))
+            return false;
+    }
+    return true;
+}
+
+/* Make sure the ring holds n elements without growing, and that they can be
+ * sorted or merged without allocating
+ */
+bool q_reserve(struct list_head *head, int n)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = q_header(head);
+    return ringGrow(q, n) && ringScratch(q, n);
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    if (!head || !q_size(head))
+        return false;
+
+    /* Close the gap from the shorter side */
+    queue_t *q = q_header(head);
+    int idx = (q->size - 1) / 2;
+    element_t *mid = *ringAt(q, idx);
+    if (idx < q->size / 2) {
+        for (int i = idx; i > 0; i--)
+            *ringAt(q, i) = *ringAt(q, i - 1);
+        q->first = (q->first + 1) & (q->cap - 1);
+    } else {
+        for (int i = idx; i < q->size - 1; i++)
+            *ringAt(q, i) = *ringAt(q, i + 1);
+    }
+    q->size--;
+
+    q_release_element(mid);
+    return true;
+}
+
+/* Decide whether an element walked by filter() stays, given its neighbors
+ * in walking order
+ */
+typedef bool (*keep_fn)(void *priv,
+                        const element_t *prev,
+                        const element_t *cur,
+                        const element_t *next);
+
+/* Walk the queue from head, or from tail if backward, and release the
+ * elements keep() rejects.  Kept elements are written back over the
+ * positions already walked, then the positions left over are cut off.
+ */
+static void filter(queue_t *q, bool backward, keep_fn keep, void *priv)
+{
+    int n = q->size, step = backward ? -1 : 1;
+    int rd = backward ? n - 1 : 0, wr = rd;
+    const element_t *prev = NULL;
+
+    /* Released at the end, so that prev stays valid */
+    LIST_HEAD(dropped);
+    for (int i = 0; i < n; i++, rd += step) {
+        element_t *cur = *ringAt(q, rd);
+        element_t *next = i + 1 < n ? *ringAt(q, rd + step) : NULL;
+        if (keep(priv, prev, cur, next)) {
+            *ringAt(q, wr) = cur;
+            wr += step;
+        } else {
+            list_add_tail(&cur->list, &dropped);
+        }
+        prev = cur;
+    }
+
+    if (backward) {
+        q->first = (q->first + wr + 1) & (q->cap - 1);
+        q->size -= wr + 1;
+    } else {
+        q->size = wr;
+    }
+
+    element_t *cur, *tmp;
+    list_for_each_entry_safe (cur, tmp, &dropped, list)
+        q_release_element(cur);
+}
+
+static bool keepDistinct(void *priv,
+                         const element_t *prev,
+                         const element_t *cur,
+                         const element_t *next)
+{
+    return !(prev && !q_cmp(prev, cur)) && !(next && !q_cmp(cur, next));
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    if (!head || !q_size(head))
+        return false;
+
+    filter(q_header(head), false, keepDistinct, NULL);
+    return true;
+}
+
+/* Slot of the hash set used by q_delete_dup_all() */
+struct dedup_slot {
+    const element_t *first; /* first element holding the string */
+    uint32_t hash;
+    bool dup;
+};
+
+struct dedup_set {
+    struct dedup_slot *slot;
+    size_t mask;
+};
+
+/* Find the slot of the string of e, which is unused if it was not met yet */
+static struct dedup_slot *dedupFind(const struct dedup_set *set,
+                                    const element_t *e)
+{
+    uint32_t hash = q_str_hash(e->value, e->len);
+    size_t i = hash & set->mask;
+    while (set->slot[i].first && (set->slot[i].hash != hash ||
+                                  strcmp(set->slot[i].first->value, e->value)))
+        i = (i + 1) & set->mask;
+    set->slot[i].hash = hash;
+    return &set->slot[i];
+}
+
+static bool keepUnique(void *priv,
+                       const element_t *prev,
+                       const element_t *cur,
+                       const element_t *next)
+{
+    return !dedupFind(priv, cur)->dup;
+}
+
+bool q_delete_dup_all(struct list_head *head)
+{
+    if (!head)
+        return false;
+    if (!q_size(head))
+        return true;
+
+    queue_t *q = q_header(head);
+
+    /* Keep the load factor at most 1/2 */
+    size_t cap = 2;
+    while (cap < 2 * (size_t) q->size)
+        cap <<= 1;
+    struct dedup_set set = {malloc(cap * sizeof(struct dedup_slot)), cap - 1};
+    if (!set.slot)
+        return false;
+    memset(set.slot, 0, cap * sizeof(struct dedup_slot));
+
+    /* Find the strings met more than once, then drop their elements */
+    for (int i = 0; i < q->size; i++) {
+        const element_t *e = *ringAt(q, i);
+        struct dedup_slot *ds = dedupFind(&set, e);
+        if (ds->first)
+            ds->dup = true;
+        else
+            ds->first = e;
+    }
+    filter(q, false, keepUnique, &set);
+
+    free(set.slot);
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = q_header(head);
+    for (int i = 0; i + 1 < q->size; i += 2)
+        ringSwap(ringAt(q, i), ringAt(q, i + 1));
+}
+
+/* Reverse elements of queue from index l to index r */
+static void ringReverse(queue_t *q, int l, int r)
+{
+    while (l < r)
+        ringSwap(ringAt(q, l++), ringAt(q, r--));
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    ringReverse(q_header(head), 0, q_size(head) - 1);
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || k < 2)
+        return;
+
+    queue_t *q = q_header(head);
+    for (int i = 0; i + k <= q->size; i += k)
+        ringReverse(q, i, i + k - 1);
+}
+
+/* Compare two elements in sorting order: negative if a goes first, zero if
+ * equal and positive if b goes first
+ */
+static inline int ringOrder(const element_t *a,
+                            const element_t *b,
+                            bool descend)
+{
+    return descend ? q_cmp(b, a) : q_cmp(a, b);
+}
+
+/* Insertion sort of a few contiguous elements */
+static void sortRun(element_t **s, int n, bool descend)
+{
+    for (int i = 1; i < n; i++) {
+        element_t *cur = s[i];
+        int j = i;
+        for (; j > 0 && ringOrder(cur, s[j - 1], descend) < 0; j--)
+            s[j] = s[j - 1];
+        s[j] = cur;
+    }
+}
+
+/* Rotate the elements from l to r - 1 so that the m-th one comes first */
+static void ringRotate(queue_t *q, int l, int m, int r)
+{
+    ringReverse(q, l, m - 1);
+    ringReverse(q, m, r - 1);
+    ringReverse(q, l, r - 1);
+}
+
+/* Stable merge of the adjacent runs from l to m - 1 and from m to r - 1 in
+ * the ring itself, by rotating the head of the longer run and the part of
+ * the other one that goes before it, then merging both sides
+ */
+static void ringMergeInPlace(queue_t *q, int l, int m, int r, bool descend)
+{
+    if (l == m || m == r)
+        return;
+    if (r - l == 2) {
+        if (ringOrder(*ringAt(q, m), *ringAt(q, l), descend) < 0)
+            ringSwap(ringAt(q, l), ringAt(q, m));
+        return;
+    }
+
+    int cut1, cut2;
+    if (m - l > r - m) {
+        /* Elements of the right run equal to the pivot stay after it */
+        cut1 = l + (m - l) / 2;
+        int lo = m, hi = r;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (ringOrder(*ringAt(q, mid), *ringAt(q, cut1), descend) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        cut2 = lo;
+    } else {
+        /* Elements of the left run equal to the pivot stay before it */
+        cut2 = m + (r - m) / 2;
+        int lo = l, hi = m;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (ringOrder(*ringAt(q, cut2), *ringAt(q, mid), descend) < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        cut1 = lo;
+    }
+
+    ringRotate(q, cut1, m, cut2);
+    int split = cut1 + cut2 - m;
+    ringMergeInPlace(q, l, cut1, split, descend);
+    ringMergeInPlace(q, split, cut2, r, descend);
+}
+
+/* Merge sort of the ring in place, for want of a scratch area reserved by
+ * q_reserve().  Stable like the merge sort through the scratch area, but
+ * merging by rotations takes O(n log^2 n) moves.
+ */
+static void ringSortInPlace(queue_t *q, bool descend)
+{
+    for (int width = 1; width < q->size; width *= 2) {
+        for (int l = 0; l + width < q->size; l += 2 * width) {
+            int r = q->size - l < 2 * width ? q->size : l + 2 * width;
+            ringMergeInPlace(q, l, l + width, r, descend);
+        }
+    }
+}
+
+/* End of the run of elements in order starting at src[i] */
+static int runEnd(element_t **src, int i, int n, bool descend)
+{
+    while (++i < n && ringOrder(src[i], src[i - 1], descend) >= 0)
+        ;
+    return i;
+}
+
+/* Natural merge sort of the n elements of the scratch area of q into the
+ * ring, merging adjacent runs by pairs back and forth between both arrays
+ * until one run is left
+ */
+static void ringMergeSort(queue_t *q, int n, bool descend)
+{
+    element_t **src = q->scratch, **dst = q->buf;
+    for (;;) {
+        int runs = 0;
+        for (int i = 0; i < n;) {
+            int mid = runEnd(src, i, n, descend);
+            int end = mid < n ? runEnd(src, mid, n, descend) : n;
+            runs += mid < n ? 2 : 1;
+
+            /* Stable merge, the earlier run wins ties */
+            int a = i, b = mid, o = i;
+            while (a < mid && b < end) {
+                if (ringOrder(src[b], src[a], descend) < 0)
+                    dst[o++] = src[b++];
+                else
+                    dst[o++] = src[a++];
+            }
+            memcpy(dst + o, src + a, (mid - a) * sizeof(*dst));
+            o += mid - a;
+            memcpy(dst + o, src + b, (end - b) * sizeof(*dst));
+            i = end;
+        }
+
+        element_t **tmp = src;
+        src = dst;
+        dst = tmp;
+        if (runs <= 2)
+            break;
+    }
+
+    if (src != q->buf)
+        memcpy(q->buf, src, n * sizeof(*src));
+    q->first = 0;
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || q_size(head) < 2)
+        return;
+
+    queue_t *q = q_header(head);
+    element_t **s = q->scratch;
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    if (q->scratch_cap < q->size) {
+        ringSortInPlace(q, descend);
+    } else {
+        ringCopyOut(q, s);
+        for (int i = 0; i < q->size; i += RING_RUN)
+            sortRun(s + i, q->size - i < RING_RUN ? q->size - i : RING_RUN,
+                    descend);
+        ringMergeSort(q, q->size, descend);
+    }
+    q_alarm_restore(&oldmask);
+}
+
+/* Sort elements of queue, by merging as this implementation has no room for
+ * the buckets of radix sort
+ */
+void q_sort_radix(struct list_head *head, bool descend)
+{
+    q_sort(head, descend);
+}
+
+static bool keepAscend(void *priv,
+                       const element_t *prev,
+                       const element_t *cur,
+                       const element_t *next)
+{
+    const element_t **min = priv;
+    if (*min && q_cmp(cur, *min) >= 0)
+        return false;
+    *min = cur;
+    return true;
+}
+
+static bool keepDescend(void *priv,
+                        const element_t *prev,
+                        const element_t *cur,
+                        const element_t *next)
+{
+    const element_t **max = priv;
+    if (*max && q_cmp(cur, *max) <= 0)
+        return false;
+    *max = cur;
+    return true;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it
+ */
+int q_ascend(struct list_head *head)
+{
+    if (!head || !q_size(head))
+        return 0;
+
+    const element_t *min = NULL;
+    filter(q_header(head), true, keepAscend, &min);
+    return q_size(head);
+}
+
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it
+ */
+int q_descend(struct list_head *head)
+{
+    if (!head || !q_size(head))
+        return 0;
+
+    const element_t *max = NULL;
+    filter(q_header(head), true, keepDescend, &max);
+    return q_size(head);
+}
+
+/* Merge all the queues into one sorted queue, which is in ascending/descending
+ * order
+ */
+int q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head))
+        return 0;
+
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    queue_t *q = q_header(first->q);
+
+    int n = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain)
+        n += q_size(ctx->q);
+    /* Only allocates if q_reserve() was not called, see there */
+    if (!ringGrow(q, n) || !ringScratch(q, n))
+        return q->size;
+
+    /* Every queue is a run in order, which are laid out one after the other
+     * in the scratch area and merged into the ring
+     */
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    n = 0;
+    list_for_each_entry (ctx, head, chain) {
+        if (!ctx->q)
+            continue;
+        queue_t *other = q_header(ctx->q);
+        ringCopyOut(other, q->scratch + n);
+        n += other->size;
+        if (other != q) {
+            other->size = 0;
+            q->mixed = true;
+        }
+    }
+    q->size = n;
+    ringMergeSort(q, n, descend);
+    q_alarm_restore(&oldmask);
+    return n;
+}
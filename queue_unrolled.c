@@ -0,0 +1,943 @@
+/* Unrolled linked list implementation of the queue
+ *
+ * Elements are referenced from chunks holding a small array of slots, and
+ * only the chunks are linked together.  Each slot caches the prefix key of
+ * its element, so iterating, comparing and moving elements mostly touch the
+ * contiguous slots instead of a cache line per element.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+const char q_backend[] = "unrolled";
+
+/* Number of slots in a chunk */
+#define CHUNK_SLOTS 32
+
+/* Empty chunks every queue keeps, which is what merging two runs of chunks
+ * may need beyond the chunks it frees, see mergeRuns()
+ */
+#define CHUNK_SPARE 2
+
+struct slot {
+    uint64_t key;
+    element_t *e;
+};
+
+/* The elements of a chunk are held in slot[start, start + count).  Chunks
+ * linked into a queue are never empty.
+ */
+typedef struct {
+    struct list_head list;
+    int start;
+    int count;
+    struct slot slot[CHUNK_SLOTS];
+} chunk_t;
+
+/* Queue header handed out by q_new()
+ * @head: head of the circular doubly-linked list of chunks
+ * @size: number of elements in the chunks
+ * @cache: slab cache the elements of this queue are allocated from
+ * @mixed: whether elements of other queues have been moved into this one
+ * @spare: empty chunks, at least CHUNK_SPARE of them
+ * @nspare: number of chunks in @spare
+ *
+ * Sorting and merging are not allowed to allocate, and rely on @spare for the
+ * chunks they fill.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    slab_cache_t *cache;
+    bool mixed;
+    struct list_head spare;
+    int nspare;
+} queue_t;
+
+/* Get the sized header of a queue, as returned by q_new() */
+static inline queue_t *q_header(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+static inline chunk_t *chunkFirst(queue_t *q)
+{
+    return list_empty(&q->head) ? NULL
+                                : list_first_entry(&q->head, chunk_t, list);
+}
+
+static inline chunk_t *chunkLast(queue_t *q)
+{
+    return list_empty(&q->head) ? NULL
+                                : list_last_entry(&q->head, chunk_t, list);
+}
+
+/* Chunk following c in the list headed by head, NULL if c is the last one */
+static inline chunk_t *chunkNext(struct list_head *head, chunk_t *c)
+{
+    return c->list.next == head ? NULL
+                              : list_entry(c->list.next, chunk_t, list);
+}
+
+static inline chunk_t *chunkPrev(struct list_head *head, chunk_t *c)
+{
+    return c->list.prev == head ? NULL
+                              : list_entry(c->list.prev, chunk_t, list);
+}
+
+/* Get an unlinked chunk, from the spare ones beyond CHUNK_SPARE if any */
+static chunk_t *chunkNew(queue_t *q)
+{
+    if (q->nspare > CHUNK_SPARE) {
+        chunk_t *c = list_first_entry(&q->spare, chunk_t, list);
+        list_del(&c->list);
+        q->nspare--;
+        return c;
+    }
+    return malloc(sizeof(chunk_t));
+}
+
+/* Unlink a chunk, keeping it as a spare one if there are too few of them */
+static void chunkPut(queue_t *q, chunk_t *c)
+{
+    list_del(&c->list);
+    if (q->nspare < CHUNK_SPARE) {
+        list_add(&c->list, &q->spare);
+        q->nspare++;
+    } else {
+        free(c);
+    }
+}
+
+/* Take a spare chunk to fill, without allocating */
+static chunk_t *chunkSpare(queue_t *q)
+{
+    chunk_t *c = list_first_entry(&q->spare, chunk_t, list);
+    list_del(&c->list);
+    q->nspare--;
+    c->start = 0;
+    c->count = 0;
+    return c;
+}
+
+/* Give a chunk back to the spare ones, without freeing */
+static inline void chunkRecycle(queue_t *q, chunk_t *c)
+{
+    list_move(&c->list, &q->spare);
+    q->nspare++;
+}
+
+/* Position of an element: slot i of chunk c */
+typedef struct {
+    chunk_t *c;
+    int i;
+} pos_t;
+
+static inline pos_t posFirst(queue_t *q)
+{
+    chunk_t *c = chunkFirst(q);
+    return (pos_t){c, c ? c->start : 0};
+}
+
+static inline pos_t posLast(queue_t *q)
+{
+    chunk_t *c = chunkLast(q);
+    return (pos_t){c, c ? c->start + c->count - 1 : 0};
+}
+
+static inline void posNext(queue_t *q, pos_t *p)
+{
+    if (++p->i == p->c->start + p->c->count) {
+        p->c = chunkNext(&q->head, p->c);
+        if (p->c)
+            p->i = p->c->start;
+    }
+}
+
+static inline void posPrev(queue_t *q, pos_t *p)
+{
+    if (--p->i < p->c->start) {
+        p->c = chunkPrev(&q->head, p->c);
+        if (p->c)
+            p->i = p->c->start + p->c->count - 1;
+    }
+}
+
+static inline struct slot *posSlot(pos_t p)
+{
+    return &p.c->slot[p.i];
+}
+
+static inline void slotSwap(struct slot *a, struct slot *b)
+{
+    struct slot tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *new = malloc(sizeof(queue_t));
+    if (!new)
+        return NULL;
+
+    INIT_LIST_HEAD(&new->spare);
+    new->nspare = 0;
+    for (int i = 0; i < CHUNK_SPARE; i++) {
+        chunk_t *c = malloc(sizeof(chunk_t));
+        if (!c)
+            goto fail;
+        list_add(&c->list, &new->spare);
+        new->nspare++;
+    }
+
+    new->cache = slab_cache_new();
+    if (!new->cache)
+        goto fail;
+    INIT_LIST_HEAD(&new->head);
+    new->size = 0;
+    new->mixed = false;
+    return &new->head;
+
+fail:;
+    chunk_t *c, *next;
+    list_for_each_entry_safe (c, next, &new->spare, list)
+        free(c);
+    free(new);
+    return NULL;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = q_header(head);
+    /* Free the queue whole even if time runs out */
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    chunk_t *c, *next;
+    if (!q->mixed && !q_intern_stat.strings &&
+        slab_cache_live(q->cache) == (size_t) q->size) {
+        /* Every element of the cache is in this queue, and no element holds
+         * a reference to an interned string
+         */
+        slab_cache_drop(q->cache);
+    } else {
+        list_for_each_entry (c, head, list) {
+            for (int i = c->start; i < c->start + c->count; i++)
+                q_release_element(c->slot[i].e);
+        }
+        slab_cache_release(q->cache);
+    }
+
+    list_for_each_entry_safe (c, next, head, list)
+        free(c);
+    list_for_each_entry_safe (c, next, &q->spare, list)
+        free(c);
+    free(q);
+    q_alarm_restore(&oldmask);
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = q_header(head);
+    element_t *new_node = q_element_new(q->cache, s);
+    if (!new_node)
+        return false;
+
+    chunk_t *c = chunkFirst(q);
+    if (!c || !c->start) {
+        c = chunkNew(q);
+        if (!c) {
+            q_release_element(new_node);
+            return false;
+        }
+        c->start = CHUNK_SLOTS;
+        c->count = 0;
+        list_add(&c->list, head);
+    }
+    c->slot[--c->start] = (struct slot){new_node->key, new_node};
+    c->count++;
+    q->size++;
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = q_header(head);
+    element_t *new_node = q_element_new(q->cache, s);
+    if (!new_node)
+        return false;
+
+    chunk_t *c = chunkLast(q);
+    if (!c || c->start + c->count == CHUNK_SLOTS) {
+        c = chunkNew(q);
+        if (!c) {
+            q_release_element(new_node);
+            return false;
+        }
+        c->start = 0;
+        c->count = 0;
+        list_add_tail(&c->list, head);
+    }
+    c->slot[c->start + c->count++] = (struct slot){new_node->key, new_node};
+    q->size++;
+    return true;
+}
+
+/* Insert several elements at head of queue */
+int q_insert_head_n(struct list_head *head, char **sv, int n)
+{
+    int cnt = 0;
+    while (cnt < n && q_insert_head(head, sv[cnt]))
+        cnt++;
+    return cnt;
+}
+
+/* Insert several elements at tail of queue */
+int q_insert_tail_n(struct list_head *head, char **sv, int n)
+{
+    int cnt = 0;
+    while (cnt < n && q_insert_tail(head, sv[cnt]))
+        cnt++;
+    return cnt;
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head))
+        return NULL;
+
+    queue_t *q = q_header(head);
+    chunk_t *c = chunkFirst(q);
+    element_t *rm_node = c->slot[c->start++].e;
+    if (!--c->count)
+        chunkPut(q, c);
+    q->size--;
+
+    q_element_copy(rm_node, sp, bufsize);
+    return rm_node;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head))
+        return NULL;
+
+    queue_t *q = q_header(head);
+    chunk_t *c = chunkLast(q);
+    element_t *rm_node = c->slot[c->start + --c->count].e;
+    if (!c->count)
+        chunkPut(q, c);
+    q->size--;
+
+    q_element_copy(rm_node, sp, bufsize);
+    return rm_node;
+}
+
+/* Remove the element at head of queue, handing its string over */
+char *q_take_head(struct list_head *head, size_t *len)
+{
+    return q_element_take(q_remove_head(head, NULL, 0), len);
+}
+
+/* Remove the element at tail of queue, handing its string over */
+char *q_take_tail(struct list_head *head, size_t *len)
+{
+    return q_element_take(q_remove_tail(head, NULL, 0), len);
+}
+
+/* Remove several elements from head of queue */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n)
+{
+    int cnt = 0;
+    element_t *e;
+    while (cnt < n && (e = q_remove_head(head, NULL, 0))) {
+        list_add_tail(&e->list, list);
+        cnt++;
+    }
+    return cnt;
+}
+
+/* Remove several elements from tail of queue */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int n)
+{
+    LIST_HEAD(removed);
+    int cnt = 0;
+    element_t *e;
+    while (cnt < n && (e = q_remove_tail(head, NULL, 0))) {
+        list_add(&e->list, &removed);
+        cnt++;
+    }
+    list_splice_tail(&removed, list);
+    return cnt;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    return q_header(head)->size;
+}
+
+/* Element at p, NULL once p went past either end */
+static inline element_t *iterAt(q_iter_t *it, pos_t p)
+{
+    it->node = p.c;
+    it->idx = p.i;
+    return p.c ? p.c->slot[p.i].e : NULL;
+}
+
+element_t *q_iter_first(struct list_head *head, q_iter_t *it)
+{
+    if (!head)
+        return NULL;
+
+    it->head = head;
+    return iterAt(it, posFirst(q_header(head)));
+}
+
+element_t *q_iter_last(struct list_head *head, q_iter_t *it)
+{
+    if (!head)
+        return NULL;
+
+    it->head = head;
+    return iterAt(it, posLast(q_header(head)));
+}
+
+element_t *q_iter_next(q_iter_t *it)
+{
+    pos_t p = {it->node, it->idx};
+    posNext(q_header(it->head), &p);
+    return iterAt(it, p);
+}
+
+element_t *q_iter_prev(q_iter_t *it)
+{
+    pos_t p = {it->node, it->idx};
+    posPrev(q_header(it->head), &p);
+    return iterAt(it, p);
+}
+
+/* Check that the chunks are linked both ways and hold size elements */
+bool q_check(struct list_head *head)
+{
+    struct list_head *cur = head->next;
+    int size = 0;
+    while (cur != head) {
+        if (!cur)
+            return false;
+        chunk_t *c = list_entry(cur, chunk_t, list);
+        if (c->count <= 0 || c->start < 0 ||
+            c->start + c->count > CHUNK_SLOTS)
+            return false;
+        size += c->count;
+        cur = cur->next;
+    }
+
+    cur = head->prev;
+    while (cur != head) {
+        if (!cur)
+            return false;
+        cur = cur->prev;
+    }
+    return size == q_header(head)->size;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return false;
+
+    queue_t *q = q_header(head);
+    int idx = (q->size - 1) / 2;
+    chunk_t *c;
+    if (idx < q->size / 2) {
+        c = chunkFirst(q);
+        while (idx >= c->count) {
+            idx -= c->count;
+            c = chunkNext(head, c);
+        }
+    } else {
+        idx = q->size - 1 - idx;
+        c = chunkLast(q);
+        while (idx >= c->count) {
+            idx -= c->count;
+            c = chunkPrev(head, c);
+        }
+        idx = c->count - 1 - idx;
+    }
+
+    /* Close the gap from the shorter side */
+    struct slot *s = &c->slot[c->start];
+    element_t *mid = s[idx].e;
+    if (idx < c->count / 2) {
+        memmove(s + 1, s, idx * sizeof(*s));
+        c->start++;
+    } else {
+        memmove(s + idx, s + idx + 1, (c->count - idx - 1) * sizeof(*s));
+    }
+    if (!--c->count)
+        chunkPut(q, c);
+    q->size--;
+
+    q_release_element(mid);
+    return true;
+}
+
+/* Decide whether an element walked by filter() stays, given its neighbors
+ * in walking order
+ */
+typedef bool (*keep_fn)(void *priv,
+                        const element_t *prev,
+                        const element_t *cur,
+                        const element_t *next);
+
+/* Walk the queue from head, or from tail if backward, and release the
+ * elements keep() rejects.  Kept slots are written back over the positions
+ * already walked, then the positions left over are cut off.
+ */
+static void filter(queue_t *q, bool backward, keep_fn keep, void *priv)
+{
+    void (*step)(queue_t *, pos_t *) = backward ? posPrev : posNext;
+    pos_t rd = backward ? posLast(q) : posFirst(q), wr = rd;
+    const element_t *prev = NULL;
+
+    /* Released at the end, so that prev stays valid */
+    LIST_HEAD(dropped);
+    while (rd.c) {
+        pos_t next = rd;
+        step(q, &next);
+        element_t *cur = posSlot(rd)->e;
+        if (keep(priv, prev, cur, next.c ? posSlot(next)->e : NULL)) {
+            *posSlot(wr) = *posSlot(rd);
+            step(q, &wr);
+        } else {
+            list_add_tail(&cur->list, &dropped);
+            q->size--;
+        }
+        prev = cur;
+        rd = next;
+    }
+
+    if (wr.c) {
+        chunk_t *c = wr.c;
+        if (backward) {
+            c->count -= wr.i + 1 - c->start;
+            c->start = wr.i + 1;
+        } else {
+            c->count = wr.i - c->start;
+        }
+        for (;;) {
+            chunk_t *next = backward ? chunkPrev(&q->head, c)
+                                     : chunkNext(&q->head, c);
+            if (!c->count || c != wr.c)
+                chunkPut(q, c);
+            if (!next)
+                break;
+            c = next;
+        }
+    }
+
+    element_t *cur, *tmp;
+    list_for_each_entry_safe (cur, tmp, &dropped, list)
+        q_release_element(cur);
+}
+
+static bool keepDistinct(void *priv,
+                         const element_t *prev,
+                         const element_t *cur,
+                         const element_t *next)
+{
+    return !(prev && !q_cmp(prev, cur)) && !(next && !q_cmp(cur, next));
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return false;
+
+    filter(q_header(head), false, keepDistinct, NULL);
+    return true;
+}
+
+/* Slot of the hash set used by q_delete_dup_all() */
+struct dedup_slot {
+    const element_t *first; /* first element holding the string */
+    uint32_t hash;
+    bool dup;
+};
+
+struct dedup_set {
+    struct dedup_slot *slot;
+    size_t mask;
+};
+
+/* Find the slot of the string of e, which is unused if it was not met yet */
+static struct dedup_slot *dedupFind(const struct dedup_set *set,
+                                    const element_t *e)
+{
+    uint32_t hash = q_str_hash(e->value, e->len);
+    size_t i = hash & set->mask;
+    while (set->slot[i].first && (set->slot[i].hash != hash ||
+                                  strcmp(set->slot[i].first->value, e->value)))
+        i = (i + 1) & set->mask;
+    set->slot[i].hash = hash;
+    return &set->slot[i];
+}
+
+static bool keepUnique(void *priv,
+                       const element_t *prev,
+                       const element_t *cur,
+                       const element_t *next)
+{
+    return !dedupFind(priv, cur)->dup;
+}
+
+bool q_delete_dup_all(struct list_head *head)
+{
+    if (!head)
+        return false;
+    if (list_empty(head))
+        return true;
+
+    queue_t *q = q_header(head);
+
+    /* Keep the load factor at most 1/2 */
+    size_t cap = 2;
+    while (cap < 2 * (size_t) q->size)
+        cap <<= 1;
+    struct dedup_set set = {malloc(cap * sizeof(struct dedup_slot)), cap - 1};
+    if (!set.slot)
+        return false;
+    memset(set.slot, 0, cap * sizeof(struct dedup_slot));
+
+    /* Find the strings met more than once, then drop their elements */
+    for (pos_t p = posFirst(q); p.c; posNext(q, &p)) {
+        const element_t *e = posSlot(p)->e;
+        struct dedup_slot *ds = dedupFind(&set, e);
+        if (ds->first)
+            ds->dup = true;
+        else
+            ds->first = e;
+    }
+    filter(q, false, keepUnique, &set);
+
+    free(set.slot);
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = q_header(head);
+    pos_t p = posFirst(q);
+    while (p.c) {
+        pos_t next = p;
+        posNext(q, &next);
+        if (!next.c)
+            break;
+        slotSwap(posSlot(p), posSlot(next));
+        posNext(q, &next);
+        p = next;
+    }
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    /* Reverse the slots of every chunk, then the order of the chunks */
+    chunk_t *c, *next;
+    list_for_each_entry_safe (c, next, head, list) {
+        struct slot *l = &c->slot[c->start], *r = l + c->count - 1;
+        while (l < r)
+            slotSwap(l++, r--);
+        list_move(&c->list, head);
+    }
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || k < 2)
+        return;
+
+    queue_t *q = q_header(head);
+    pos_t first = posFirst(q);
+    for (int group = q->size / k; group; group--) {
+        pos_t last = first;
+        for (int i = 1; i < k; i++)
+            posNext(q, &last);
+        pos_t l = first, r = last;
+        for (int i = 0; i < k / 2; i++) {
+            slotSwap(posSlot(l), posSlot(r));
+            posNext(q, &l);
+            posPrev(q, &r);
+        }
+        posNext(q, &last);
+        first = last;
+    }
+}
+
+/* Compare two slots in sorting order: negative if a goes first, zero if
+ * equal and positive if b goes first
+ */
+static inline int slotOrder(const struct slot *a,
+                            const struct slot *b,
+                            bool descend)
+{
+    if (q_prefix_key && a->key != b->key) {
+        q_cmp_stat.total++;
+        q_cmp_stat.by_key++;
+        return (a->key < b->key) == !descend ? -1 : 1;
+    }
+    return descend ? q_cmp(b->e, a->e) : q_cmp(a->e, b->e);
+}
+
+/* Insertion sort of the slots of a chunk, which are few and contiguous */
+static void sortChunk(chunk_t *c, bool descend)
+{
+    struct slot *s = &c->slot[c->start];
+    for (int i = 1; i < c->count; i++) {
+        struct slot cur = s[i];
+        int j = i;
+        for (; j > 0 && slotOrder(&cur, &s[j - 1], descend) < 0; j--)
+            s[j] = s[j - 1];
+        s[j] = cur;
+    }
+}
+
+/* Cut the longest run of chunks in order from the head of list into run */
+static void cutRun(struct list_head *list, struct list_head *run, bool descend)
+{
+    chunk_t *c = list_first_entry(list, chunk_t, list), *next;
+    while ((next = chunkNext(list, c)) &&
+           slotOrder(&next->slot[next->start],
+                     &c->slot[c->start + c->count - 1], descend) >= 0)
+        c = next;
+    list_cut_position(run, list, &c->list);
+}
+
+/* Merge the chunks of runs a and b, a holding the earlier elements, into the
+ * tail of out.
+ *
+ * Output chunks are taken from the spare ones of q, and input chunks are
+ * given back as soon as they are consumed.  When the k-th output chunk is
+ * needed, (k - 1) * CHUNK_SLOTS slots were consumed, at most 2 * CHUNK_SLOTS
+ * - 2 of which from the two chunks being consumed: at least k - 2 chunks were
+ * given back, so CHUNK_SPARE spare chunks are enough.
+ */
+static void mergeRuns(queue_t *q,
+                      struct list_head *a,
+                      struct list_head *b,
+                      struct list_head *out,
+                      bool descend)
+{
+    chunk_t *ca = list_first_entry(a, chunk_t, list);
+    chunk_t *cb = list_first_entry(b, chunk_t, list);
+    chunk_t *co = NULL;
+    while (ca && cb) {
+        struct slot take;
+        if (slotOrder(&cb->slot[cb->start], &ca->slot[ca->start], descend) <
+            0) {
+            take = cb->slot[cb->start++];
+            if (!--cb->count) {
+                chunk_t *next = chunkNext(b, cb);
+                chunkRecycle(q, cb);
+                cb = next;
+            }
+        } else {
+            take = ca->slot[ca->start++];
+            if (!--ca->count) {
+                chunk_t *next = chunkNext(a, ca);
+                chunkRecycle(q, ca);
+                ca = next;
+            }
+        }
+
+        if (!co || co->count == CHUNK_SLOTS) {
+            co = chunkSpare(q);
+            list_add_tail(&co->list, out);
+        }
+        co->slot[co->count++] = take;
+    }
+
+    /* The chunks left are in order.  Top the last output chunk up from the
+     * first of them, so that no merge takes more chunks than it gives back.
+     */
+    chunk_t *cr = ca ? ca : cb;
+    struct list_head *rest = ca ? a : b;
+    int n = CHUNK_SLOTS - co->count;
+    if (n > cr->count)
+        n = cr->count;
+    memcpy(&co->slot[co->count], &cr->slot[cr->start], n * sizeof(*co->slot));
+    co->count += n;
+    cr->start += n;
+    cr->count -= n;
+    if (!cr->count)
+        chunkRecycle(q, cr);
+    list_splice_tail_init(rest, out);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || q_size(head) < 2)
+        return;
+
+    queue_t *q = q_header(head);
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    chunk_t *c;
+    list_for_each_entry (c, head, list)
+        sortChunk(c, descend);
+
+    /* Natural merge sort over runs of chunks, merging them by pairs until
+     * one run is left
+     */
+    for (;;) {
+        LIST_HEAD(list);
+        LIST_HEAD(out);
+        int runs = 0;
+        list_splice_init(head, &list);
+        while (!list_empty(&list)) {
+            LIST_HEAD(a);
+            LIST_HEAD(b);
+            cutRun(&list, &a, descend);
+            runs++;
+            if (list_empty(&list)) {
+                list_splice_tail(&a, &out);
+                break;
+            }
+            cutRun(&list, &b, descend);
+            runs++;
+            mergeRuns(q, &a, &b, &out, descend);
+        }
+        list_splice(&out, head);
+        if (runs <= 2)
+            break;
+    }
+    q_alarm_restore(&oldmask);
+}
+
+/* Sort elements of queue, by merging as this implementation has no room for
+ * the buckets of radix sort
+ */
+void q_sort_radix(struct list_head *head, bool descend)
+{
+    q_sort(head, descend);
+}
+
+static bool keepAscend(void *priv,
+                       const element_t *prev,
+                       const element_t *cur,
+                       const element_t *next)
+{
+    const element_t **min = priv;
+    if (*min && q_cmp(cur, *min) >= 0)
+        return false;
+    *min = cur;
+    return true;
+}
+
+static bool keepDescend(void *priv,
+                        const element_t *prev,
+                        const element_t *cur,
+                        const element_t *next)
+{
+    const element_t **max = priv;
+    if (*max && q_cmp(cur, *max) <= 0)
+        return false;
+    *max = cur;
+    return true;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it
+ */
+int q_ascend(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return 0;
+
+    const element_t *min = NULL;
+    filter(q_header(head), true, keepAscend, &min);
+    return q_size(head);
+}
+
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it
+ */
+int q_descend(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return 0;
+
+    const element_t *max = NULL;
+    filter(q_header(head), true, keepDescend, &max);
+    return q_size(head);
+}
+
+/* Nothing to reserve, elements are linked */
+bool q_reserve(struct list_head *head, int n)
+{
+    return head;
+}
+
+/* Merge all the queues into one sorted queue, which is in ascending/descending
+ * order
+ */
+int q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head))
+        return 0;
+
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    queue_t *q = q_header(first->q);
+
+    /* Every queue is a run of chunks in order, which q_sort() merges with
+     * the spare chunks of the first queue
+     */
+    queue_contex_t *ctx;
+    sigset_t oldmask;
+    q_alarm_block(&oldmask);
+    list_for_each_entry (ctx, head, chain) {
+        if (ctx == first || !ctx->q || list_empty(ctx->q))
+            continue;
+        queue_t *other = q_header(ctx->q);
+        list_splice_tail_init(&other->head, &q->head);
+        q->size += other->size;
+        other->size = 0;
+        q->mixed = true;
+    }
+    q_sort(first->q, descend);
+    q_alarm_restore(&oldmask);
+    return q->size;
+}
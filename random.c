@@ -30,6 +30,13 @@
 
 #include "random.h"
 
+#include <assert.h>
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#else /* Assume POSIX environments */
+#include <time.h>
+#endif
+
 #if defined(__linux__) || defined(__GNU__)
 /* We would need to include <linux/random.h>, but not every target has access
  * to the linux headers. We only need RNDGETENTCNT, so we instead inline it.
@@ -293,3 +300,23 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+uintptr_t os_random(uintptr_t seed)
+{
+    /* ASLR makes the address random */
+    uintptr_t x = (uintptr_t) &os_random ^ seed;
+#if defined(__APPLE__)
+    x ^= (uintptr_t) mach_absolute_time();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    x ^= (uintptr_t) time.tv_sec;
+    x ^= (uintptr_t) time.tv_nsec;
+#endif
+    /* Do a few randomization steps */
+    uintptr_t max = ((x ^ (x >> 17)) & 0x0F) + 1;
+    for (uintptr_t i = 0; i < max; i++)
+        x = random_shuffle(x);
+    assert(x);
+    return x;
+}
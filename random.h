@@ -6,6 +6,11 @@
 
 extern int randombytes(uint8_t *buf, size_t len);
 
+/* Random nonzero seed derived from the address space layout, the clock and
+ * seed
+ */
+uintptr_t os_random(uintptr_t seed);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
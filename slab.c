@@ -0,0 +1,288 @@
+/* Slab allocator for queue elements */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+#include "slab.h"
+
+/* Slabs are accounted through the harness directly */
+#define INTERNAL 1
+#include "harness.h"
+
+/* Size classes are multiples of SLAB_ALIGN, including the object header */
+#define SLAB_ALIGN 16
+#define SLAB_MAX_BLOCK 256
+#define SLAB_CLASSES (SLAB_MAX_BLOCK / SLAB_ALIGN)
+
+/* Bytes requested from the harness for every slab */
+#define SLAB_SIZE (16 * 1024)
+
+/* Every object is preceded by a header word holding the address of its slab,
+ * or zero if it got a block of its own.  The low bit is set while the object
+ * sits on the free list of its slab.
+ */
+#define SLAB_FREE_BIT ((uintptr_t) 1)
+
+/* Site of the blocks which are not live */
+#define SLAB_NO_SITE ALLOC_SITES
+
+/* The call site of each block is kept in a byte at the start of mem, so
+ * that frees are charged to it, and dropping a cache only reads these bytes
+ * instead of the blocks
+ */
+typedef struct __slab {
+    struct list_head list; /* Node in partial[cls] or full of the cache */
+    slab_cache_t *cache;
+    uintptr_t *free;  /* Free list of released blocks */
+    char *bump, *end; /* Blocks never handed out yet */
+    char *blocks;     /* First block */
+    unsigned char *site;
+    size_t block_size;
+    unsigned int live;
+    unsigned int cls;
+    char mem[];
+} slab_t;
+
+struct slab_cache {
+    struct list_head partial[SLAB_CLASSES]; /* Slabs with free blocks */
+    struct list_head full;                  /* Slabs without free blocks */
+    size_t live;
+    size_t slabs;
+    bool orphan; /* Released while some objects were still live */
+};
+
+static inline bool slab_is_full(const slab_t *slab)
+{
+    return !slab->free && slab->bump == slab->end;
+}
+
+static slab_t *slab_new(slab_cache_t *cache, unsigned int cls)
+{
+    slab_t *slab = test_malloc_slab(SLAB_SIZE);
+    if (!slab)
+        return NULL;
+
+    size_t block_size = (cls + 1) * SLAB_ALIGN;
+    size_t blocks =
+        (SLAB_SIZE - sizeof(slab_t) - SLAB_ALIGN + 1) / (block_size + 1);
+    slab->cache = cache;
+    slab->free = NULL;
+    slab->site = (unsigned char *) slab->mem;
+    slab->blocks = slab->mem + ((blocks + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1));
+    slab->bump = slab->blocks;
+    slab->end = slab->blocks + blocks * block_size;
+    slab->block_size = block_size;
+    slab->live = 0;
+    slab->cls = cls;
+    list_add(&slab->list, &cache->partial[cls]);
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(slab_t *slab)
+{
+    list_del(&slab->list);
+    slab->cache->slabs--;
+    test_free(slab);
+}
+
+slab_cache_t *slab_cache_new()
+{
+    slab_cache_t *cache = test_malloc(sizeof(slab_cache_t));
+    if (!cache)
+        return NULL;
+
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        INIT_LIST_HEAD(&cache->partial[i]);
+    INIT_LIST_HEAD(&cache->full);
+    cache->live = 0;
+    cache->slabs = 0;
+    cache->orphan = false;
+    return cache;
+}
+
+/* Index of block b in its slab */
+static inline size_t slab_index(const slab_t *slab, const uintptr_t *b)
+{
+    return ((const char *) b - slab->blocks) / slab->block_size;
+}
+
+static void *slab_get(slab_cache_t *cache,
+                      size_t size,
+                      const char *file,
+                      int line,
+                      const char *func)
+{
+    /* Objects get blocks of their own while the harness quarantines freed
+     * blocks, as a slot returned to its slab would be reused at once
+     */
+    size_t block_size =
+        (size + sizeof(uintptr_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    if (block_size > SLAB_MAX_BLOCK || quarantine_bytes > 0) {
+        uintptr_t *b =
+            test_malloc_at(sizeof(uintptr_t) + size, file, line, func);
+        if (!b)
+            return NULL;
+        *b = 0;
+        return b + 1;
+    }
+
+    /* An empty slab made for an object whose allocation then fails is kept
+     * for the next one
+     */
+    unsigned int cls = block_size / SLAB_ALIGN - 1;
+    slab_t *slab;
+    if (list_empty(&cache->partial[cls])) {
+        slab = slab_new(cache, cls);
+        if (!slab)
+            return NULL;
+    } else {
+        slab = list_first_entry(&cache->partial[cls], slab_t, list);
+    }
+
+    int site = test_slab_claim(block_size - sizeof(uintptr_t), file, line,
+                               func);
+    if (site < 0)
+        return NULL;
+
+    uintptr_t *b;
+    if (slab->free) {
+        b = slab->free;
+        slab->free = *(uintptr_t **) (b + 1);
+    } else {
+        b = (uintptr_t *) slab->bump;
+        slab->bump += block_size;
+    }
+    *b = (uintptr_t) slab;
+    slab->site[slab_index(slab, b)] = site;
+    slab->live++;
+    cache->live++;
+
+    if (slab_is_full(slab))
+        list_move(&slab->list, &cache->full);
+    return b + 1;
+}
+
+static void slab_put(void *p)
+{
+    uintptr_t *b = (uintptr_t *) p - 1;
+    if (!*b) {
+        test_free(b);
+        return;
+    }
+
+    if (*b & SLAB_FREE_BIT) {
+        test_slab_error(p);
+        return;
+    }
+
+    slab_t *slab = (slab_t *) *b;
+    unsigned char *site = &slab->site[slab_index(slab, b)];
+    test_slab_release(*site, 1, slab->block_size - sizeof(uintptr_t));
+    *site = SLAB_NO_SITE;
+
+    slab_cache_t *cache = slab->cache;
+    bool was_full = slab_is_full(slab);
+    *b |= SLAB_FREE_BIT;
+    *(uintptr_t **) p = slab->free;
+    slab->free = b;
+    slab->live--;
+    cache->live--;
+
+    struct list_head *partial = &cache->partial[slab->cls];
+    if (was_full)
+        list_move(&slab->list, partial);
+
+    /* Keep a single empty slab per size class around for reuse */
+    if (!slab->live && (cache->orphan || !list_is_singular(partial))) {
+        slab_destroy(slab);
+        if (cache->orphan && !cache->slabs)
+            test_free(cache);
+    }
+}
+
+/* A time limit running out inside the slab lists is raised once they are
+ * consistent again
+ */
+void *slab_alloc_at(slab_cache_t *cache,
+                    size_t size,
+                    const char *file,
+                    int line,
+                    const char *func)
+{
+    alloc_enter();
+    void *p = slab_get(cache, size, file, line, func);
+    alloc_leave();
+    return p;
+}
+
+void slab_free(void *p)
+{
+    if (!p)
+        return;
+
+    alloc_enter();
+    slab_put(p);
+    alloc_leave();
+}
+
+size_t slab_cache_live(const slab_cache_t *cache)
+{
+    return cache->live;
+}
+
+/* Add up the live blocks of a slab and their bytes by call site */
+static void slab_count(const slab_t *slab, size_t *cnt, size_t *bytes)
+{
+    size_t n = slab_index(slab, (const uintptr_t *) slab->bump);
+    for (size_t i = 0; i < n; i++) {
+        unsigned int site = slab->site[i];
+        if (site != SLAB_NO_SITE) {
+            cnt[site]++;
+            bytes[site] += slab->block_size - sizeof(uintptr_t);
+        }
+    }
+}
+
+void slab_cache_drop(slab_cache_t *cache)
+{
+    size_t cnt[ALLOC_SITES] = {0}, bytes[ALLOC_SITES] = {0};
+    slab_t *slab, *safe;
+    alloc_enter();
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        list_for_each_entry_safe (slab, safe, &cache->partial[i], list) {
+            slab_count(slab, cnt, bytes);
+            test_free(slab);
+        }
+    }
+    list_for_each_entry_safe (slab, safe, &cache->full, list) {
+        slab_count(slab, cnt, bytes);
+        test_free(slab);
+    }
+
+    for (int site = 0; site < ALLOC_SITES; site++) {
+        if (cnt[site])
+            test_slab_release(site, cnt[site], bytes[site]);
+    }
+    test_free(cache);
+    alloc_leave();
+}
+
+void slab_cache_release(slab_cache_t *cache)
+{
+    slab_t *slab, *safe;
+    alloc_enter();
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        list_for_each_entry_safe (slab, safe, &cache->partial[i], list) {
+            if (!slab->live)
+                slab_destroy(slab);
+        }
+    }
+
+    if (!cache->slabs)
+        test_free(cache);
+    else
+        cache->orphan = true;
+    alloc_leave();
+}
@@ -0,0 +1,80 @@
+#ifndef LAB0_SLAB_H
+#define LAB0_SLAB_H
+
+/* Slab allocator for queue elements.
+ *
+ * Small objects are carved out of large blocks, called slabs, which belong to
+ * a cache.  Each cache keeps one list of slabs per size class, so that
+ * objects of similar size are packed next to each other and allocation is a
+ * pointer bump or a pop from a free list.  Objects too large for any size
+ * class get a block of their own, and so does every object while the harness
+ * keeps a quarantine, so that writes after free are caught for them too.
+ *
+ * Every object is still accounted by the harness as a separate allocation,
+ * see test_slab_claim().
+ */
+
+#include <stddef.h>
+
+typedef struct slab_cache slab_cache_t;
+
+/**
+ * slab_cache_new() - Create an empty cache
+ *
+ * Return: NULL for allocation failed
+ */
+slab_cache_t *slab_cache_new();
+
+/**
+ * slab_alloc_at() - Allocate an object from a cache
+ * @cache: cache the object is carved from
+ * @size: size of the object in bytes
+ * @file: file of the call site, as accounted by the harness
+ * @line: line of the call site
+ * @func: function of the call site
+ *
+ * Return: NULL for allocation failed
+ */
+void *slab_alloc_at(slab_cache_t *cache,
+                    size_t size,
+                    const char *file,
+                    int line,
+                    const char *func);
+
+/* Allocate an object, recording where it is allocated */
+#define slab_alloc(cache, size) \
+    slab_alloc_at(cache, size, __FILE__, __LINE__, __func__)
+
+/**
+ * slab_free() - Return an object to the slab it was carved from
+ * @p: object allocated by slab_alloc(), no effect if NULL
+ *
+ * The object may be released after its cache has been released.
+ */
+void slab_free(void *p);
+
+/**
+ * slab_cache_live() - Get the number of live objects of a cache
+ * @cache: cache to query
+ */
+size_t slab_cache_live(const slab_cache_t *cache);
+
+/**
+ * slab_cache_drop() - Release a cache together with all of its objects
+ * @cache: cache to drop
+ *
+ * Every slab is freed at once, without visiting the objects.  The caller
+ * must guarantee that no live object of @cache is referenced anymore.
+ */
+void slab_cache_drop(slab_cache_t *cache);
+
+/**
+ * slab_cache_release() - Release a cache whose objects may still be in use
+ * @cache: cache to release
+ *
+ * Empty slabs are freed immediately.  The remaining ones, and the cache
+ * itself, are freed once their last object is returned by slab_free().
+ */
+void slab_cache_release(slab_cache_t *cache);
+
+#endif /* LAB0_SLAB_H */
@@ -0,0 +1,198 @@
+# Test performance of merging 64 sorted queues of 50000 elements each
+option fail 0
+option malloc 0
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+new
+ih RAND 50000
+sort
+time merge
+size
+free
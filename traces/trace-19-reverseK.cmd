@@ -0,0 +1,10 @@
+# Test performance of reverseK with small and large groups
+option fail 0
+option malloc 0
+new
+ih RAND 1000000
+time reverseK 3
+time reverseK 1000
+time reverseK 3
+size
+free
@@ -0,0 +1,24 @@
+# Test of bulk insertions and removals
+option fail 0
+option malloc 0
+new
+ih RAND 2000
+it gerbil 2000
+ih dolphin 3
+rhn 2
+rh dolphin
+rtn 1999
+rt gerbil
+size
+rtn 0
+rhn 5000
+size
+rhn 10
+it bear 1500
+ih meerkat 1500
+rtn 1499
+rhn 1499
+rh meerkat
+rt bear
+size
+free
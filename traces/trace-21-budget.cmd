@@ -0,0 +1,25 @@
+# Test that sorting out of time fails but leaves the queue whole
+option fail 0
+option malloc 0
+new
+ih RAND 200000
+it gerbil 1000
+option budget_ms 1
+xfail sort
+option budget_ms 1000
+size
+option sortalgo radix
+option descend 1
+option budget_ms 1
+xfail sort
+option budget_ms 1000
+size
+option sortalgo merge
+option descend 0
+new
+ih RAND 200000
+option budget_ms 1
+xfail sort
+option budget_ms 1000
+free
+free